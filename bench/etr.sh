@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Compare early token release (-t) with releasing the token when the
+# frame comes back, for short and long frames.
+#
+# For each payload length runs the discrete-event engine, which gives
+# the time in byte times, so longer frames take longer, and a live
+# ring, timed by the wall clock, with and without -t.  Any tokensim arguments can be given and are
+# added to every run; the default is a 16 node frame mode ring with
+# four frame transmit queues, which keeps every node busy.
+#
+#	usage: bench/etr.sh [tokensim args]
+#
+# Run from the top of the source tree.  Live runs only gain from -t
+# when there are cores for the nodes to run on at once.
+#
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O2 -pedantic -Wall"}
+SRCS=`echo tokenRing_*.c`
+PACKETS=${PACKETS:-100000}
+LENGTHS=${LENGTHS:-"16 250"}
+
+if [ $# -eq 0 ]; then
+	set -- -f -l spsc -n 16 -q 4 -s 1
+fi
+
+dir=`mktemp -d` || exit 1
+trap 'rm -rf "$dir"' 0
+
+$CC $CFLAGS -o "$dir/tokensim" $SRCS -lpthread || exit 1
+
+elapsed()
+{
+	start=`date +%s.%N`
+	"$@" >/dev/null 2>&1
+	end=`date +%s.%N`
+	echo "$start $end" | awk '{ printf "%.3fs", $2 - $1 }'
+}
+
+printf "%-6s %-8s %12s %10s\n" length release ticks live
+for len in $LENGTHS; do
+	for etr in "" -t; do
+		ticks=`"$dir/tokensim" -e $etr -L $len "$@" $PACKETS 2>/dev/null \
+			| awk '/^des:/ { print $8 }'`
+		live=`elapsed "$dir/tokensim" $etr -L $len "$@" $PACKETS`
+		release=normal
+		[ -n "$etr" ] && release=early
+		printf "%-6s %-8s %12s %10s\n" $len $release "$ticks" "$live"
+	done
+done
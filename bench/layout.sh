@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Compare the cache-line aware memory layout with the old packed one.
+#
+# Builds tokensim twice, once normally and once with -DPACKED_LAYOUT,
+# runs both on the same workload with the perf counters on (-p) and
+# prints the counter lines side by side.  Any tokensim arguments can be
+# given; the default is a frame mode run on lock-free links.
+#
+#	usage: bench/layout.sh [tokensim args]
+#
+# Run from the top of the source tree.  Hardware counters need a
+# kernel.perf_event_paranoid setting that lets users count their own
+# processes, and are shown as n/a where the machine does not expose them.
+#
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O2 -pedantic -Wall"}
+SRCS=`echo tokenRing_*.c`
+
+if [ $# -eq 0 ]; then
+	set -- -f -l spsc -n 16 20000
+fi
+
+dir=`mktemp -d` || exit 1
+trap 'rm -rf "$dir"' 0
+
+$CC $CFLAGS -o "$dir/aligned" $SRCS -lpthread || exit 1
+$CC $CFLAGS -DPACKED_LAYOUT -o "$dir/packed" $SRCS -lpthread || exit 1
+
+for layout in packed aligned; do
+	"$dir/$layout" -p "$@" 2>/dev/null | grep '^perf:'
+	echo
+done
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Compare destination stripping (-D) with the sender stripping its own
+# frame when it comes back, with and without early token release (-t,
+# which with -D gives spatial reuse).
+#
+# Runs the discrete-event engine, which gives the time in link ticks and
+# the share of handoffs that carried frames, and a live ring, timed by
+# the wall clock, for each of the four.  Any tokensim arguments can be
+# given and are added to every run; the default is a 16 node frame mode
+# ring with four frame transmit queues, which keeps every node busy.
+#
+#	usage: bench/strip.sh [tokensim args]
+#
+# Run from the top of the source tree.
+#
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O2 -pedantic -Wall"}
+SRCS=`echo tokenRing_*.c`
+PACKETS=${PACKETS:-100000}
+
+if [ $# -eq 0 ]; then
+	set -- -f -l spsc -n 16 -q 4 -s 1
+fi
+
+dir=`mktemp -d` || exit 1
+trap 'rm -rf "$dir"' 0
+
+$CC $CFLAGS -o "$dir/tokensim" $SRCS -lpthread || exit 1
+
+elapsed()
+{
+	start=`date +%s.%N`
+	"$@" >/dev/null 2>&1
+	end=`date +%s.%N`
+	echo "$start $end" | awk '{ printf "%.3fs", $2 - $1 }'
+}
+
+printf "%-12s %12s %8s %10s\n" strip ticks busy live
+for mode in source destination early spatial; do
+	case $mode in
+	source)		opts= ;;
+	destination)	opts=-D ;;
+	early)		opts=-t ;;
+	spatial)	opts="-t -D" ;;
+	esac
+	out=`"$dir/tokensim" -e $opts -T 1 "$@" $PACKETS 2>/dev/null`
+	ticks=`echo "$out" | awk '/^des:/ { print $8 }'`
+	busy=`echo "$out" | sed -n 's/.*utilisation \([0-9.]*%\).*/\1/p'`
+	live=`elapsed "$dir/tokensim" $opts "$@" $PACKETS`
+	printf "%-12s %12s %8s %10s\n" $mode "$ticks" "$busy" "$live"
+done
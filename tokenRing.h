@@ -2,6 +2,11 @@
 #define __TOKEN_CONTROL_HEADER__
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
 /*
  * Define any handy constants and structures.
  * Also define the functions.
@@ -13,35 +18,282 @@
 #define	LEN		4
 #define	DATA		5
 #define	DONE		6
+#define	FCS		7	/* after DATA, FCS_BYTES of frame check */
 
+#define	FCS_BYTES	4
 
-#define	N_NODES		7
+/*
+ * Link transfer modes.  XFER_BYTE moves one byte per handoff and is
+ * kept as the reference path; XFER_FRAME hands a complete frame
+ * (header plus length data bytes) to the next node in one go.
+ */
+#define	XFER_BYTE	0
+#define	XFER_FRAME	1
+
+/*
+ * Link implementations.  LINK_SEM is a bounded buffer of link_depth
+ * slots in link_data, with EMPTY counting the free slots and FILLED the
+ * full ones; LINK_SPSC is a lock-free single-producer/single-consumer
+ * ring buffer of link_depth elements.
+ */
+#define	LINK_SEM	0
+#define	LINK_SPSC	1
+
+#define	LINK_DEPTH_DEFAULT	1
+
+/*
+ * Link delay in byte mode.  With a delay of d every link has d bytes on
+ * it at all times, FILL_BYTE where there is nothing else to send, so a
+ * byte takes d byte times to get to the next node and the ring holds
+ * n_nodes * d of them.  A delay of 0 leaves just the one byte on the
+ * ring.
+ */
+#define	FILL_BYTE	'-'
+
+/*
+ * Virtual clock (-B): every handoff is stamped with the simulated time
+ * its first byte reaches the next node, a byte time plus the link's
+ * propagation delay after it leaves, so a run reports seconds on a ring
+ * of a given line rate however fast it really went.  The link is busy
+ * for a byte time for each byte it carries: a frame's flag, addresses,
+ * length, payload and FCS, and a token's flag.
+ */
+#define	FRAME_OVERHEAD		(1 + 2 * ADDR_BYTES + 1 + FCS_BYTES)
+#define	FRAME_WIRE_BYTES(pkt)	((pkt)->token_flag == '0' ? 1 \
+		: FRAME_OVERHEAD + (pkt)->length)
+
+/*
+ * Frames each node can have queued for sending.  With the default of 1
+ * the generator waits whenever it picks a node that has not sent its
+ * last frame yet.
+ */
+#define	TXQ_DEPTH_DEFAULT	1
+
+/*
+ * Access priorities, as on 802.5: frames go at priority 0 (the lowest)
+ * up to MAX_PRIO - 1, each node keeps a transmit queue per priority,
+ * and a token may only be taken for a frame of at least its priority.
+ * Only frame mode carries them.
+ */
+#define	MAX_PRIO		8
+
+/*
+ * Multicast: a frame with to_group set goes to every member of group
+ * to but its sender, each of which takes a copy as it goes past.  Group
+ * BROADCAST_GROUP has every node in it.  Groups stay on their ring.
+ */
+#define	MAX_GROUPS		256
+#define	BROADCAST_GROUP		0
+#define	MCAST_PCT_DEFAULT	10
+
+#define	ROT_INTERVAL_DEFAULT	1000	/* us, or ticks under -e	*/
+
+/*
+ * Latency histograms (-H), see tokenRing_hist.c.  Each node keeps one of
+ * each kind: queueing from tx_push() to the head of the queue, access
+ * from there to the frame going out on a token, and delivery from
+ * tx_push() to the frame's header reaching its destination.  Times are
+ * ring_now() units.
+ */
+#define	LAT_QUEUE	0
+#define	LAT_ACCESS	1
+#define	LAT_DELIVERY	2
+#define	N_LAT		3
+
+#define	HIST_SUB_BITS	4
+#define	HIST_SUB	(1 << HIST_SUB_BITS)
+#define	HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define	CACHE_LINE	64
+
+/*
+ * Shared state is laid out so that what one link or one node touches on
+ * its hot path sits on cache lines of its own, and neighbouring node
+ * threads do not keep invalidating each other's lines.  Building with
+ * -DPACKED_LAYOUT packs everything back together, which is only useful
+ * for measuring the difference (see bench/layout.sh).
+ */
+#ifdef PACKED_LAYOUT
+#define	CACHE_ALIGNED
+#else
+#define	CACHE_ALIGNED	_Alignas(CACHE_LINE)
+#endif
+
+/*
+ * How a node waits on a LINK_SPSC link that is empty (or full).
+ * LINK_SEM links always block on their semaphores.
+ */
+#define	WAIT_BLOCK	0	/* park on a semaphore			*/
+#define	WAIT_SPIN	1	/* busy-poll with pause, never park	*/
+#define	WAIT_SPINPARK	2	/* bounded spin, then futex wait	*/
+#define	WAIT_FUTEX	3	/* futex wait/wake straight away	*/
+
+#define	WAIT_SPIN_LIMIT	2000
+
+/*
+ * The number of nodes is picked at run time.  Node numbers are 16 bits,
+ * sent high byte first in byte mode.
+ */
+#define	N_NODES_DEFAULT	7
+#define	MAX_NODES	65535
+#define	ADDR_BYTES	2
+
+#define	NODE_STACK_SIZE	(64 * 1024)
+
+/*
+ * A campus is several rings, each run by its own control structure.
+ * Node BRIDGE_NODE of every ring is its bridge: it copies frames for
+ * other rings into their bridge queues, and puts what arrives in its
+ * own queue on its ring.  A frame a full queue turns away goes back to
+ * its sender marked refused, and the sender sends it again.  Only frame
+ * mode carries ring numbers.
+ */
+#define	MAX_RINGS		256
+#define	BRIDGE_NODE		0
+#define	BRIDGE_QUEUE_DEPTH	256
+
+typedef unsigned short	node_addr;
 
+/* byte i (0 = most significant) of an address on the wire */
+#define	ADDR_BYTE(a, i)	(((a) >> (8 * (ADDR_BYTES - 1 - (i)))) & 0xff)
 
 struct data_pkt {
 	char		token_flag;	/* '1' for token, '0' for data	*/
-	char		to;		/* Destination node #		*/
-	char		from;		/* Source node #		*/
+	unsigned char	priority;	/* of the frame, or the token	*/
+	unsigned char	reservation;	/* highest priority waiting	*/
+	unsigned char	to_group;	/* to is a multicast group	*/
+	unsigned char	refused;	/* a full bridge queue turned	*/
+					/* it away: send it again	*/
+	node_addr	to;		/* Destination node #		*/
+	node_addr	from;		/* Source node #		*/
+	node_addr	to_ring;	/* Destination ring #		*/
+	node_addr	from_ring;	/* Source ring #		*/
 	unsigned char	length;		/* Data length 1<->MAX_DATA	*/
+	uint32_t	fcs;		/* CRC32C, see frame_fcs()	*/
+	const char	*payload;	/* the sender's data, zero-copy	*/
+	unsigned long long queued_at;	/* ring_now() at tx_push()	*/
 	char		data[MAX_DATA];	/* Up to MAX_DATA bytes of data	*/
 };
 
+/* what a link carries of a frame when the payload goes by reference */
+#define	FRAME_HEADER	offsetof(struct data_pkt, data)
+
+/*
+ * The shared memory region is split in two arrays.  link[n] is the link
+ * into node n, the bytes or frames being handed over from node n - 1;
+ * its two ends are written on every transfer, by different nodes, so
+ * each starts a cache line.
+ * node[n] holds node n's own state: the flags and counters it touches on
+ * every byte on one line, the transmit queue the generator fills and
+ * the node empties on the next, and the generator's end of the queue
+ * on a line of its own.
+ */
+struct link_data {
+	CACHE_ALIGNED unsigned next_empty;	/* slot the writer fills next	*/
+	unsigned	vt_in;		/* arrival times written	*/
+	CACHE_ALIGNED unsigned next_full;	/* slot the reader empties next	*/
+	unsigned	vt_out;		/* arrival times read		*/
+	unsigned char	*data_xfer;	/* byte mode slots, link_depth	*/
+	struct data_pkt	*frame_xfer;	/* frame mode slots, link_depth	*/
+	unsigned long long *vt;		/* virtual clock: when what is	*/
+					/* on the link arrives		*/
+};
+
 /*
- * The shared memory region includes a byte used to transfer data between
- * the nodes, a packet structure for each node with a packet to send and
- * sent/received counts for the nodes.
+ * Where a node is in the byte mode receive and send state machines.
+ * It lives with the node rather than on a thread's stack so that any
+ * worker can run the node a byte at a time (tokenRing_sched.c).
  */
+struct node_state {
+	int		rcv_state;	/* TOKEN_FLAG..DONE of the incoming frame */
+	int		snd_state;	/* TOKEN_FLAG..FCS of send_pkt()	*/
+	char		producer;	/* holding the token, sending to_send	*/
+	int		strip;		/* bytes to take off before our	*/
+					/* frame is all back			*/
+	char		group;		/* the incoming frame is multicast	*/
+	char		mine;		/* and is for us			*/
+	int		hdrpos;		/* address or FCS byte being received	*/
+	int		addr;		/* address being assembled		*/
+	int		to;		/* and the incoming frame's, whole	*/
+	int		from;
+	uint32_t	crc;		/* CRC32C of it so far, when mine	*/
+	uint32_t	fcs;		/* the FCS it carries			*/
+	int		len;		/* data length of the incoming frame	*/
+	int		sending;	/* data bytes passed on so far		*/
+	int		sndpos;		/* next data byte to send		*/
+	int		sndlen;		/* data length being sent		*/
+	int		snd_hdrpos;	/* address byte being sent		*/
+	int		in_flight;	/* early token release: a frame we	*/
+					/* sent has not come back yet		*/
+	int		held;		/* frames sent on this token capture	*/
+	int		held_bytes;	/* and their payload bytes		*/
+	int		bridged;	/* bridge queue frames sent on it	*/
+	int		bridged_bytes;	/* and their payload bytes		*/
+	int		bridge_turn;	/* bridge queue first on the next token	*/
+	int		tx_prio;	/* queue the frame being sent is from	*/
+	int		token_prio;	/* priority of the token we hold	*/
+	int		stacked;	/* tokens we raised, not yet lowered	*/
+	unsigned char	stack_old[MAX_PRIO];	/* priority before each	*/
+	unsigned char	stack_new[MAX_PRIO];	/* and after		*/
+};
+
 struct node_data {
-	unsigned char	data_xfer;
-	struct data_pkt	to_send;
-	int		sent;
-	int		received;
-	int		terminate;
+	CACHE_ALIGNED atomic_int terminate;
+	int		sent;		/* only written by this node	*/
+	int		received;	/* only written by this node	*/
+	int		fcs_errors;	/* frames for us that failed FCS */
+	int		mcast_sent;	/* of sent, to a group		*/
+	int		mcast_received;	/* of received, to a group	*/
+	long long	xfers;		/* bytes or frames handed on	*/
+	long long	payload_sent;	/* data bytes of sent		*/
+	unsigned long long vnow;	/* virtual clock, in ps: latest	*/
+					/* arrival			*/
+	unsigned long long vfree;	/* outbound link clear again	*/
+	unsigned long long vdone;	/* our last frame back		*/
+	unsigned long long vtoken;	/* the token last went past	*/
+	unsigned long long rot_sum;	/* token rotations seen when	*/
+	unsigned long long rot_max;	/* taking the token		*/
+	int		rot_n;
+	long long	idle;		/* of which free tokens		*/
+	int		captures;	/* times we took the token	*/
+	int		held_max;	/* most frames sent on one	*/
+	unsigned long long wait_sum;	/* ring_now() from tx_push() to	*/
+	unsigned long long wait_max;	/* the frame going out		*/
+	int		prio_sent[MAX_PRIO];	/* the same per priority */
+	unsigned long long prio_wait[MAX_PRIO];
+	unsigned long long prio_wait_max[MAX_PRIO];
+	struct hist	*lat;		/* N_LAT histograms, with -H	*/
+	unsigned long long head_at[MAX_PRIO];	/* when the head of each */
+					/* queue got there, with -H	*/
+	unsigned long long tx_queued_at;	/* of the frame going out, */
+					/* for byte mode destinations	*/
+	struct hist	*rotation;	/* token rotations, with -R	*/
+	unsigned long long token_at;	/* ring_now() the free token	*/
+					/* last came past		*/
+	atomic_ullong	rot_count;	/* rotations, their total time	*/
+	atomic_ullong	rot_total;	/* and the longest since the	*/
+	atomic_ullong	rot_peak;	/* sampler last looked		*/
+	struct node_state state;	/* only touched by this node	*/
+	CACHE_ALIGNED atomic_int pending;	/* frames in txq	*/
+	unsigned	tx_head[MAX_PRIO];	/* next to send, moved by the node */
+	struct data_pkt	**txq;		/* cfg.txq_depth pooled frames	*/
+					/* per priority			*/
+	CACHE_ALIGNED atomic_uint tx_tail[MAX_PRIO];	/* next free, moved */
+					/* by the generator		*/
+	int		queued;		/* frames generated for the node */
+	int		txq_max;	/* deepest the queue has been	*/
+	long long	txq_sum;	/* queue depth seen by each frame */
+	int		txq_full;	/* times the generator waited	*/
+	CACHE_ALIGNED atomic_int delivered;	/* destination stripping: */
+					/* our frame reached its destination */
 };
 
 struct shared_data {
-	struct node_data node[N_NODES];
-    volatile int cleanup_in_progress;  
+	struct link_data *link;		/* cfg.n_nodes entries	*/
+	struct node_data *node;		/* cfg.n_nodes entries	*/
+	struct data_pkt	**txq;		/* every node's transmit queue	*/
+	struct hist	*lat;		/* every node's histograms	*/
+	CACHE_ALIGNED atomic_int cleanup_in_progress;  
 };
 
 /*
@@ -50,25 +302,197 @@ struct shared_data {
  * to_send shared data structures and also to indicate when data transfers
  * occur between nodes.
  * Macros with the node # as argument are used to access the sets of
- * semaphores.
+ * semaphores.  CRIT comes first and each node's set follows, so the
+ * layout does not depend on the size of the ring.
+ *
+ * The array is cache line aligned and padded: CRIT has a line to
+ * itself, EMPTY(n) and FILLED(n) (the link into node n) share one line,
+ * and TO_SEND(n), which only the generator and node n use, gets the
+ * next.  The padding entries are never initialised.
+ */
+#define	CRIT		0
+
+#ifdef PACKED_LAYOUT
+#define	SEMS_PER_LINE	1
+#define	EMPTY(n)	(CRIT + 1 + 3 * (n))
+#define	FILLED(n)	(EMPTY(n) + 1)
+#define	TO_SEND(n)	(EMPTY(n) + 2)
+#define	NUM_SEM(nodes)	(CRIT + 1 + 3 * (nodes))
+#else
+#define	SEMS_PER_LINE	(CACHE_LINE / sizeof(sem_t) < 2 ? 2 : CACHE_LINE / sizeof(sem_t))
+#define	EMPTY(n)	(SEMS_PER_LINE * (1 + 2 * (n)))
+#define	FILLED(n)	(EMPTY(n) + 1)
+#define	TO_SEND(n)	(EMPTY(n) + SEMS_PER_LINE)
+#define	NUM_SEM(nodes)	(SEMS_PER_LINE * (1 + 2 * (nodes)))
+#endif
+
+/*
+ * Building with -DSEM_STATS counts, for every semaphore in sems, the
+ * waits on it, how many of those found it taken, and how long they
+ * spent blocked, and writes it all to SEM_STATS_FILE at cleanup.  While
+ * the ring runs each semaphore has one thread that waits on it, so the
+ * counts are plain.
+ * Without it SEM_WAIT() and SEM_TRYWAIT() are sem_wait() and
+ * sem_trywait() themselves.
+ */
+#ifdef SEM_STATS
+#ifndef SEM_STATS_FILE
+#define	SEM_STATS_FILE	"sem_stats.json"
+#endif
+
+struct sem_stats {
+	unsigned long long acquired;	/* waits that got it		*/
+	unsigned long long contended;	/* of them, found it taken	*/
+	unsigned long long blocked_ns;	/* and then waited this long	*/
+};
+
+#define	SEM_WAIT(control, sem)		sem_wait_counted((control), (sem))
+#define	SEM_TRYWAIT(control, sem)	sem_trywait_counted((control), (sem))
+#else
+#define	SEM_WAIT(control, sem)		sem_wait(&(control)->sems[sem])
+#define	SEM_TRYWAIT(control, sem)	sem_trywait(&(control)->sems[sem])
+#endif
+
+/*
+ * Something one thread can wait on and another can signal; see
+ * tokenRing_wait.c.  seq doubles as the futex word.
  */
-#define	EMPTY0		0
-#define	FILLED0		(N_NODES)
-#define	TO_SEND0	(FILLED0 + N_NODES)
-#define	CRIT		(TO_SEND0 + N_NODES)
-#define	NUM_SEM		(CRIT + 1)
+struct wait_event {
+	atomic_uint	seq;
+	atomic_int	waiters;
+	sem_t		sem;
+};
 
-#define	EMPTY(n)	(EMPTY0 + (n))
-#define	FILLED(n)	(FILLED0 + (n))
-#define	TO_SEND(n)	(TO_SEND0 + (n))
+/*
+ * Inbound link of a node when running with LINK_SPSC.  head is only
+ * written by the node reading the link, tail only by the upstream node
+ * writing it; each side keeps a private copy of the other's counter so
+ * it only touches the shared line when the buffer looks empty/full.
+ */
+struct spsc_link {
+	CACHE_ALIGNED atomic_uint head;
+	unsigned	cached_tail;	/* reader's view of tail	*/
+	CACHE_ALIGNED atomic_uint tail;
+	unsigned	cached_head;	/* writer's view of head	*/
+	CACHE_ALIGNED unsigned mask;
+	size_t		elem_size;
+	unsigned char	*buf;
+	CACHE_ALIGNED struct wait_event data_ev;	/* writer -> reader	*/
+	CACHE_ALIGNED struct wait_event space_ev;	/* reader -> writer	*/
+};
+
+struct hist {
+	CACHE_ALIGNED unsigned long long count;
+	unsigned long long sum;
+	unsigned long long min;
+	unsigned long long max;
+	uint32_t	buckets[HIST_BUCKETS];
+};
+
+/*
+ * A pool of fixed-size objects, all allocated up front; see
+ * tokenRing_pool.c.  top is the head of the free list.
+ */
+struct pool {
+	CACHE_ALIGNED _Atomic unsigned long long top;
+	CACHE_ALIGNED atomic_int in_use;
+	atomic_int	high_water;	/* most ever in use at once	*/
+	atomic_int	exhausted;	/* times a get found none left	*/
+	atomic_int	starved;	/* getters waiting for a put	*/
+	struct wait_event free_ev;
+	int		wait_strategy;
+	unsigned	n_objs;
+	size_t		obj_size;
+	unsigned char	*objs;
+	atomic_uint	*next;		/* free list links, index + 1	*/
+};
+
+/*
+ * Run time options, filled in from the command line.
+ */
+struct TokenRingConfig {
+	int		n_nodes;	/* stations on the ring		*/
+	int		xfer_mode;	/* XFER_BYTE or XFER_FRAME	*/
+	int		zero_copy;	/* frames carry a payload	*/
+					/* reference, not the data	*/
+	int		etr;		/* early token release		*/
+	unsigned	tht_frames;	/* token holding time: frames	*/
+	unsigned	tht_bytes;	/* and payload bytes per capture, */
+					/* 0 = no limit			*/
+	int		tht_report;	/* report holding and fairness	*/
+	int		n_prio;		/* access priorities in use	*/
+	int		dest_strip;	/* destinations take frames off	*/
+	int		n_groups;	/* multicast groups, 0 = none	*/
+	int		mcast_pct;	/* share of frames sent to one	*/
+	int		latency;	/* keep latency histograms	*/
+	unsigned long long rot_interval;	/* rotation series sample	*/
+					/* interval, 0 = no rotation times */
+	const char	*rot_file;	/* to write them to as JSON	*/
+	int		link_type;	/* LINK_SEM or LINK_SPSC	*/
+	unsigned	link_depth;	/* elements per link		*/
+	unsigned	link_delay;	/* byte times per link, 0 = one	*/
+					/* byte on the ring		*/
+	unsigned	txq_depth;	/* frames per transmit queue	*/
+	unsigned	pool_frames;	/* frame pool size, 0 = enough	*/
+					/* to fill every queue		*/
+	int		wait_strategy;	/* WAIT_ for LINK_SPSC links	*/
+	int		perf;		/* report hardware counters	*/
+	int		workers;	/* M:N worker threads, 0 = a	*/
+					/* thread per node		*/
+	int		des;		/* discrete-event engine	*/
+	unsigned	seed;		/* for the packet generator	*/
+	int		max_len;	/* longest payload generated	*/
+	int		generators;	/* packet generator threads	*/
+	double		line_rate;	/* virtual clock Mb/s, 0 = off	*/
+	unsigned long long byte_ps;	/* time to send a byte		*/
+	unsigned long long prop_ps;	/* and for it to cross a link	*/
+	int		n_rings;	/* rings on the campus		*/
+	int		ring;		/* which one this is		*/
+};
+
+/*
+ * Frames waiting at a ring's bridge to be put on the ring.  Any other
+ * ring's bridge adds to it, under lock; only this ring's bridge takes
+ * from it.
+ */
+struct bridge_queue {
+	pthread_mutex_t	lock;
+	struct data_pkt	*pkts;		/* BRIDGE_QUEUE_DEPTH entries	*/
+	unsigned	done;		/* next to come back round	*/
+	unsigned	head;		/* next to put on the ring	*/
+	unsigned	tail;
+	int		refused;	/* arrived with the queue full	*/
+	CACHE_ALIGNED atomic_int queued;	/* frames in pkts	*/
+	atomic_int	backlog;	/* queued, or going round	*/
+	int		forwarded;	/* sent on to other rings	*/
+	int		injected;	/* put on this ring		*/
+};
 
 typedef struct TokenRingData {
+    struct TokenRingConfig cfg;
     sem_t *sems;  
-    int snd_state;
+#ifdef SEM_STATS
+    struct sem_stats *sem_stats;	/* one per entry in sems */
+#endif
+    struct spsc_link *links;
+    struct sched_pool *sched;
+    struct campus *campus;
+    struct bridge_queue *bridge;
+    struct pool *frames;
+    uint64_t *groups;		/* cfg.n_groups bitmaps of members */
+    size_t group_words;		/* words in each		*/
+    unsigned long long des_now;	/* discrete-event clock, in ticks */
+    unsigned long long started;	/* ring_now() at startNodes()	*/
+    unsigned long long stopped;	/* and at stopNodes()		*/
+    unsigned vt_mask;		/* arrival times per link, less one */
+    struct random_data rng;
+    char rng_state[128];
     struct shared_data *shared_ptr;  
-    pthread_t threads[N_NODES];
-    int node_numbers[N_NODES];
+    pthread_t *threads;
+    int *node_numbers;
     struct token_args *thread_args;
+    struct perf_counters *perf;
+    struct rotation *rotation;
     pthread_mutex_t mutex;  
     volatile int termination_flag;  
 } TokenRingData;
@@ -78,16 +502,303 @@ struct token_args {
     int node_num;
 };
 
+/*
+ * Termination flags are only ever raised during a run, so the hot paths
+ * poll them with plain atomic loads instead of taking CRIT.
+ */
+static inline int
+node_terminating(struct TokenRingData *control, int num)
+{
+	return atomic_load_explicit(&control->shared_ptr->node[num].terminate,
+			memory_order_acquire) ||
+		atomic_load_explicit(&control->shared_ptr->cleanup_in_progress,
+			memory_order_acquire);
+}
+
+/*
+ * The highest priority node num has a frame queued at, or -1 if it has
+ * none.
+ */
+static inline int
+tx_prio_pending(struct TokenRingData *control, int num)
+{
+	struct node_data *node = &control->shared_ptr->node[num];
+	int p;
+
+	for (p = control->cfg.n_prio - 1; p >= 0; p--) {
+		if (atomic_load_explicit(&node->tx_tail[p], memory_order_acquire)
+				!= node->tx_head[p])
+			return p;
+	}
+	return -1;
+}
+
+/*
+ * The frame node num is sending or about to send: the head of its
+ * transmit queue for priority state.tx_prio (see tx_start()).
+ */
+static inline struct data_pkt *
+tx_head(struct TokenRingData *control, int num)
+{
+	struct node_data *node = &control->shared_ptr->node[num];
+	int p = node->state.tx_prio;
+
+	return node->txq[(size_t) p * control->cfg.txq_depth
+		+ node->tx_head[p] % control->cfg.txq_depth];
+}
+
+/*
+ * Whether node num is in multicast group group.
+ */
+static inline int
+mcast_member(struct TokenRingData *control, int group, int num)
+{
+	const uint64_t *bits = control->groups + (size_t) group * control->group_words;
+
+	return (bits[num / 64] >> (num % 64)) & 1;
+}
+
+/*
+ * Whether a frame going past node num is for it: addressed to it, or to
+ * a group it is in.
+ */
+static inline int
+pkt_for(struct TokenRingData *control, int num, const struct data_pkt *pkt)
+{
+	if (pkt->to_group)
+		return mcast_member(control, pkt->to, num);
+	return pkt->to == num && pkt->to_ring == control->cfg.ring;
+}
+
+/*
+ * The payload of a frame a node has received.  With zero-copy it is a
+ * read-only view of the sender's buffer, good until the sender strips
+ * the frame.
+ */
+static inline const char *
+pkt_payload(struct TokenRingData *control, const struct data_pkt *pkt)
+{
+	return control->cfg.zero_copy ? pkt->payload : pkt->data;
+}
+
+/*
+ * Tell the CPU we are in a spin loop.
+ */
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Trace events, recorded by DEBUG builds in place of printing them when
+ * $TOKENSIM_TRACE is set; see tokenRing_trace.c.  Each thread has a
+ * buffer of its own, written without locks and flushed at exit, which
+ * tracedump turns into Chrome trace JSON.  byte and state are the byte moved and
+ * the receive or send state of the node, arg depends on the event.
+ */
+#define	TR_START	1	/* node starts, byte the token if first	*/
+#define	TR_STOP		2	/* node stops				*/
+#define	TR_SEND		3	/* byte out, arg the next node		*/
+#define	TR_RCV		4	/* byte in				*/
+#define	TR_WAIT_EMPTY	5	/* blocking for room on the link to arg	*/
+#define	TR_GOT_EMPTY	6
+#define	TR_WAIT_FILLED	7	/* blocking for a byte or frame		*/
+#define	TR_GOT_FILLED	8
+#define	TR_TOKEN	9	/* free token here, byte 1 if taken	*/
+#define	TR_FRAME_START	10	/* our frame starts, arg its destination */
+#define	TR_FRAME_END	11	/* and its last byte is out		*/
+#define	TR_SEND_FRAME	12	/* frame mode: byte the flag, arg next	*/
+#define	TR_RCV_FRAME	13	/* and in				*/
+#define	TR_STRIP	14	/* our frame is back			*/
+#define	TR_DEST_STRIP	15	/* destination took it off, arg sender	*/
+#define	TR_DELIVER	16	/* a frame for us, arg sender, byte len	*/
+#define	TR_BAD_FCS	17	/* one that failed the check		*/
+#define	TR_QUEUE	18	/* generator queued a frame, byte len, arg to */
+#define	TR_NUM		19
+
+#define	TRACE_MAGIC	"TRTRACE1"
+#ifndef TRACE_EVENTS
+#define	TRACE_EVENTS	4096	/* per thread, a power of two	*/
+#endif
+#ifndef TRACE_MEMORY
+#define	TRACE_MEMORY	(64 << 20)	/* for all the buffers	*/
+#endif
+#ifndef TRACE_FILE
+#define	TRACE_FILE	"tokensim.trace"
+#endif
+
+struct trace_event {
+	uint64_t	tsc;		/* trace_clock()		*/
+	uint16_t	node;
+	uint16_t	arg;
+	uint8_t		event;		/* TR_				*/
+	uint8_t		byte;
+	uint8_t		state;
+	uint8_t		pad;
+};
+
+/*
+ * A thread's events.  next only ever grows; the last TRACE_EVENTS are
+ * kept.
+ */
+struct trace_buf {
+	struct trace_buf *link;		/* every thread's, for the flush */
+	unsigned	thread;		/* in order of first event	*/
+	unsigned long long next;
+	struct trace_event events[TRACE_EVENTS];
+};
+
+extern _Thread_local struct trace_buf *trace_mine;
+extern _Thread_local int trace_none;	/* this thread records nothing */
+struct trace_buf *trace_attach(void);
+
+static inline uint64_t
+trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static inline void
+trace_event(int event, int node, unsigned byte, int state, int arg)
+{
+	struct trace_buf *tb = trace_mine;
+	struct trace_event *e;
+
+	if (tb == NULL && (trace_none || (tb = trace_attach()) == NULL))
+		return;
+	e = &tb->events[tb->next++ & (TRACE_EVENTS - 1)];
+	e->tsc = trace_clock();
+	e->node = (uint16_t) node;
+	e->arg = (uint16_t) arg;
+	e->event = (uint8_t) event;
+	e->byte = (uint8_t) byte;
+	e->state = (uint8_t) state;
+	e->pad = 0;
+}
+
+#ifdef DEBUG
+#define	TRACE(event, node, byte, state, arg) \
+	trace_event((event), (node), (byte), (state), (arg))
+#else
+#define	TRACE(event, node, byte, state, arg)	((void) 0)
+#endif
+
 /** prototypes */
 void panic(const char *fmt, ...);
 
-struct TokenRingData *setupSystem();
+struct TokenRingData *setupSystem(const struct TokenRingConfig *cfg);
 int runSimulation(struct TokenRingData *simulationData, int numPackets);
+int startNodes(struct TokenRingData *control);
+void generatePackets(struct TokenRingData *control, int numPackets);
+void stopNodes(struct TokenRingData *control);
 int cleanupSystem(struct TokenRingData *simulationData);
+void generate_pkt(struct TokenRingData *control, struct random_data *rng,
+		int num, struct data_pkt *pkt);
+void tx_push(struct TokenRingData *control, int num, struct data_pkt *pkt);
+void tx_pop(struct TokenRingData *control, int num);
+struct data_pkt *tx_start(struct TokenRingData *control, int num);
+int tx_more(struct TokenRingData *control, int num);
+int token_capture(struct TokenRingData *control, int num,
+		struct data_pkt *token);
+void token_release(struct TokenRingData *control, int num, int res,
+		struct data_pkt *token);
+void frame_reserve(struct TokenRingData *control, int num,
+		struct data_pkt *pkt);
+void token_seen(struct TokenRingData *control, int num, int captured);
+unsigned long long ring_now(struct TokenRingData *control);
+#ifdef SEM_STATS
+int sem_wait_counted(struct TokenRingData *control, int sem);
+int sem_trywait_counted(struct TokenRingData *control, int sem);
+#endif
+long ring_random(struct TokenRingData *control);
+long gen_random(struct random_data *rng);
+int des_run(struct TokenRingData *control, int numPackets);
 
 unsigned char rcv_byte(struct TokenRingData *control, int num);
 void send_byte(struct TokenRingData *control, int num, unsigned byte);
 void send_pkt(struct TokenRingData *control, int num);
+int rcv_frame(struct TokenRingData *control, int num, struct data_pkt *pkt);
+int frame_check(struct TokenRingData *control, int num,
+		const struct data_pkt *pkt);
+void send_frame(struct TokenRingData *control, int num,
+		const struct data_pkt *pkt);
 void *token_node(void *arg);
+void token_node_start(struct TokenRingData *control, int num);
+int token_node_byte(struct TokenRingData *control, int num, unsigned byte);
+void token_node_frame(struct TokenRingData *control, int num,
+		struct data_pkt *pkt);
+
+void crc32c_init(void);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t fcs_header(int to, int from, int to_ring, int from_ring, int group,
+		int length);
+uint32_t frame_fcs(const struct data_pkt *pkt, const char *payload);
+
+int campus_run(const struct TokenRingConfig *cfg, int numPackets);
+int bridge_forward(struct TokenRingData *control, const struct data_pkt *pkt);
+int bridge_take(struct TokenRingData *control, struct data_pkt *pkt, int room);
+void bridge_stripped(struct TokenRingData *control);
+
+int sched_init(struct TokenRingData *control);
+void sched_destroy(struct TokenRingData *control);
+int sched_start(struct TokenRingData *control);
+void sched_stop(struct TokenRingData *control);
+void sched_wake(struct TokenRingData *control, int num);
+void sched_link_released(struct TokenRingData *control, int num);
+
+void *alloc_aligned(size_t nmemb, size_t size);
+
+int pool_init(struct pool *pool, unsigned n_objs, size_t obj_size, int strategy);
+void pool_destroy(struct pool *pool);
+void *pool_get(struct pool *pool);
+void *pool_get_wait(struct pool *pool);
+void pool_put(struct pool *pool, void *obj);
+
+void hist_record(struct hist *h, unsigned long long v);
+void hist_merge(struct hist *dst, const struct hist *src);
+unsigned long long hist_percentile(const struct hist *h, double pct);
+
+int rotation_start(struct TokenRingData *control);
+void rotation_token(struct TokenRingData *control, int num);
+void rotation_tick(struct TokenRingData *control, unsigned long long now);
+void rotation_stop(struct TokenRingData *control);
+void rotation_report(struct TokenRingData *control);
+
+int perf_start(struct TokenRingData *control);
+void perf_stop(struct TokenRingData *control);
+void perf_report(struct TokenRingData *control);
+
+int spsc_link_init(struct spsc_link *link, unsigned depth, size_t elem_size);
+void spsc_link_destroy(struct spsc_link *link);
+void *spsc_try_write_slot(struct spsc_link *link);
+int spsc_has_room(struct spsc_link *link, unsigned n);
+void spsc_publish(struct spsc_link *link);
+void *spsc_try_read_slot(struct spsc_link *link);
+void spsc_release(struct spsc_link *link);
+void *spsc_write_slot(struct TokenRingData *control, int node);
+void *spsc_read_slot(struct TokenRingData *control, int node);
+void spsc_write_done(struct TokenRingData *control, int node);
+void spsc_read_done(struct TokenRingData *control, int node);
+void spsc_link_wake(struct spsc_link *link, int strategy);
+
+int wait_strategy_from_name(const char *name);
+const char *wait_strategy_name(int strategy);
+int wait_event_init(struct wait_event *ev);
+void wait_event_destroy(struct wait_event *ev);
+unsigned wait_event_prepare(struct wait_event *ev);
+void wait_event_wait(struct wait_event *ev, unsigned key, int strategy);
+void wait_event_signal(struct wait_event *ev, int strategy);
 
 #endif /* __TOKEN_CONTROL_HEADER__ */
\ No newline at end of file
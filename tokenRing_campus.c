@@ -0,0 +1,290 @@
+/*
+ * A campus of rings (tokensim -r).
+ *
+ * Each ring is a TokenRingData of its own, set up, run and torn down
+ * just as a single ring is, by a driver thread pinned to a core of its
+ * own.  The node threads or workers the driver starts inherit the
+ * pinning, so rings do not compete for cores while there are enough
+ * of them to go round.
+ *
+ * Frames carry ring qualified addresses (to_ring, from_ring).  The
+ * bridge node of each ring copies frames for other rings into the
+ * bridge queue of the ring they are for, and puts the frames in its own
+ * queue on its ring when it has the token (see token_node_frame()).  A
+ * frame that arrives at a full queue is not copied.  The bridge marks it
+ * refused as it goes past, and the sender keeps it and sends it again
+ * on a later token, so a full queue holds senders back instead of
+ * losing their frames.  No bridge ever waits for another ring, which
+ * could be waiting for it in turn.  The copy
+ * always includes the payload, since with zero-copy the sender strips
+ * its frame long before the other ring is done with it; a frame keeps
+ * its place in the queue until it has been round this ring, so its
+ * payload can be passed by reference in turn.
+ *
+ * Shutting down takes one step more than for a single ring.  Once a
+ * ring has sent all its own packets, frames from other rings may still
+ * be on their way to it.  So the drivers meet at a barrier first.  After
+ * it nothing new gets forwarded, because a frame passes its ring's
+ * bridge before its sender strips it.  Each driver then waits for its
+ * bridge queue to drain.
+ */
+#define	_GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "tokenRing.h"
+
+struct ring_driver {
+	struct campus	*campus;
+	int		ring;
+	pthread_t	thread;
+	double		seconds;	/* start to stop	*/
+};
+
+struct campus {
+	int		n_rings;
+	int		n_packets;	/* generated by each ring	*/
+	struct TokenRingData **rings;
+	struct ring_driver *drivers;
+	pthread_barrier_t sent;		/* every ring has sent its own	*/
+};
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Pin the calling thread to the ring'th of the cores we may run on.
+ * Not being able to is not worth failing the run over.
+ */
+static void
+pin_ring(int ring)
+{
+	cpu_set_t allowed, mine;
+	int cpu, n = 0, want;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+	want = ring % CPU_COUNT(&allowed);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		if (n++ == want) {
+			CPU_ZERO(&mine);
+			CPU_SET(cpu, &mine);
+			pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+			return;
+		}
+	}
+}
+
+/*
+ * Copy a frame for another ring into that ring's bridge queue.  Called
+ * by the bridge node of the ring the frame is going past on.  Returns 0
+ * if the queue is full.
+ */
+int
+bridge_forward(struct TokenRingData *control, const struct data_pkt *pkt)
+{
+	struct bridge_queue *bq = control->campus->rings[pkt->to_ring]->bridge;
+
+	struct data_pkt *slot;
+
+	pthread_mutex_lock(&bq->lock);
+	if (bq->tail - bq->done == BRIDGE_QUEUE_DEPTH) {
+		bq->refused++;
+		pthread_mutex_unlock(&bq->lock);
+		return 0;
+	}
+	slot = &bq->pkts[bq->tail++ % BRIDGE_QUEUE_DEPTH];
+	memcpy(slot, pkt, FRAME_HEADER);
+	memcpy(slot->data, pkt_payload(control, pkt), pkt->length);
+	slot->payload = slot->data;
+	atomic_fetch_add(&bq->backlog, 1);
+	atomic_fetch_add_explicit(&bq->queued, 1, memory_order_release);
+	pthread_mutex_unlock(&bq->lock);
+
+	control->bridge->forwarded++;
+	return 1;
+}
+
+/*
+ * Take the next frame to put on this ring off the bridge queue, if its
+ * payload is no more than room bytes.  Frames for the bridge node itself
+ * are delivered on the spot.  Returns 0 if there is nothing to send.
+ */
+int
+bridge_take(struct TokenRingData *control, struct data_pkt *pkt, int room)
+{
+	struct bridge_queue *bq = control->bridge;
+	struct data_pkt *slot;
+
+	if (atomic_load_explicit(&bq->queued, memory_order_acquire) == 0)
+		return 0;
+
+	pthread_mutex_lock(&bq->lock);
+	while (bq->head != bq->tail) {
+		slot = &bq->pkts[bq->head % BRIDGE_QUEUE_DEPTH];
+		if (slot->to != BRIDGE_NODE && slot->length > room)
+			break;
+		bq->head++;
+		atomic_fetch_sub_explicit(&bq->queued, 1, memory_order_relaxed);
+		if (slot->to == BRIDGE_NODE) {
+			frame_check(control, BRIDGE_NODE, slot);
+			bq->done++;
+			atomic_fetch_sub(&bq->backlog, 1);
+			continue;
+		}
+		memcpy(pkt, slot, control->cfg.zero_copy ? FRAME_HEADER
+				: FRAME_HEADER + slot->length);
+		pthread_mutex_unlock(&bq->lock);
+		bq->injected++;
+		return 1;
+	}
+	pthread_mutex_unlock(&bq->lock);
+	return 0;
+}
+
+/*
+ * A frame the bridge put on the ring has come back round, and its place
+ * in the queue can go.
+ */
+void
+bridge_stripped(struct TokenRingData *control)
+{
+	struct bridge_queue *bq = control->bridge;
+
+	pthread_mutex_lock(&bq->lock);
+	bq->done++;
+	pthread_mutex_unlock(&bq->lock);
+	atomic_fetch_sub(&bq->backlog, 1);
+}
+
+static void *
+ring_driver(void *arg)
+{
+	struct ring_driver *drv = arg;
+	struct campus *campus = drv->campus;
+	struct TokenRingData *control = campus->rings[drv->ring];
+	struct timespec start;
+
+	pin_ring(drv->ring);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (control->cfg.perf && perf_start(control) < 0) {
+		panic("Failed to start counters for ring %d\n", drv->ring);
+	}
+	if (startNodes(control) < 0) {
+		panic("Failed to start ring %d\n", drv->ring);
+	}
+	generatePackets(control, campus->n_packets);
+
+	pthread_barrier_wait(&campus->sent);
+	while (atomic_load(&control->bridge->backlog) > 0) {
+		usleep(100);
+	}
+
+	stopNodes(control);
+	perf_stop(control);
+	drv->seconds = elapsed(&start);
+	return NULL;
+}
+
+static void
+campus_report(struct campus *campus, double seconds)
+{
+	struct TokenRingData *control;
+	long sent, received, total = 0;
+	int r, i, refused = 0;
+
+	for (r = 0; r < campus->n_rings; r++) {
+		control = campus->rings[r];
+		sent = received = 0;
+		for (i = 0; i < control->cfg.n_nodes; i++) {
+			sent += control->shared_ptr->node[i].sent;
+			received += control->shared_ptr->node[i].received;
+		}
+		total += received;
+		refused += control->bridge->refused;
+		printf("ring %d: sent %ld received %ld bridged out %d in %d "
+				"refused %d, %.3fs, %.0f frames/s\n", r, sent, received,
+				control->bridge->forwarded, control->bridge->injected,
+				control->bridge->refused, campus->drivers[r].seconds,
+				received / campus->drivers[r].seconds);
+	}
+	printf("campus: %d rings, %ld frames delivered in %.3fs, %.0f frames/s, "
+			"%d refused by full bridge queues and sent again\n",
+			campus->n_rings, total, seconds, total / seconds, refused);
+}
+
+/*
+ * Set up a ring per cfg->n_rings, run them all with numPackets packets
+ * each, report and tear down.
+ */
+int
+campus_run(const struct TokenRingConfig *cfg, int numPackets)
+{
+	struct campus campus;
+	struct TokenRingConfig rcfg;
+	struct timespec start;
+	int r, ret = -1;
+
+	memset(&campus, 0, sizeof(campus));
+	campus.n_rings = cfg->n_rings;
+	campus.n_packets = numPackets;
+	campus.rings = calloc(cfg->n_rings, sizeof(struct TokenRingData *));
+	campus.drivers = calloc(cfg->n_rings, sizeof(struct ring_driver));
+	if (!campus.rings || !campus.drivers) {
+		fprintf(stderr, "Failed to allocate campus\n");
+		goto OUT;
+	}
+
+	for (r = 0; r < cfg->n_rings; r++) {
+		rcfg = *cfg;
+		rcfg.ring = r;
+		if ((campus.rings[r] = setupSystem(&rcfg)) == NULL) {
+			goto OUT;
+		}
+		campus.rings[r]->campus = &campus;
+	}
+
+	if (pthread_barrier_init(&campus.sent, NULL, cfg->n_rings) != 0) {
+		fprintf(stderr, "Failed to initialize campus barrier\n");
+		goto OUT;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < cfg->n_rings; r++) {
+		campus.drivers[r].campus = &campus;
+		campus.drivers[r].ring = r;
+		if (pthread_create(&campus.drivers[r].thread, NULL,
+				ring_driver, &campus.drivers[r]) != 0) {
+			panic("Thread creation failed for ring %d\n", r);
+		}
+	}
+	for (r = 0; r < cfg->n_rings; r++) {
+		pthread_join(campus.drivers[r].thread, NULL);
+	}
+	campus_report(&campus, elapsed(&start));
+	pthread_barrier_destroy(&campus.sent);
+	ret = 0;
+
+OUT:
+	for (r = 0; campus.rings && r < cfg->n_rings; r++) {
+		if (campus.rings[r]) {
+			cleanupSystem(campus.rings[r]);
+		}
+	}
+	free(campus.rings);
+	free(campus.drivers);
+	return ret;
+}
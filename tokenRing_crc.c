@@ -0,0 +1,149 @@
+/*
+ * CRC32C (Castagnoli) frame check sequence.
+ *
+ * On x86 CPUs with SSE4.2 the crc32 instruction does eight bytes at a
+ * time; everywhere else a slicing-by-8 table walk does.  crc32c_init()
+ * picks one once, before any frames are built.
+ *
+ * The FCS covers the addresses, the group flag and the length, high
+ * byte first, and then the payload.  The token flag is left out: it is
+ * flipped from token to frame when the frame goes out, as on a real
+ * ring.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "tokenRing.h"
+
+#define	CRC32C_POLY	0x82F63B78u	/* reflected Castagnoli	*/
+
+static uint32_t crc_table[8][256];
+static uint32_t (*crc_update)(uint32_t crc, const unsigned char *buf, size_t len);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	for (; len >= 8; len -= 8, buf += 8) {
+		crc ^= buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t) buf[3] << 24;
+		crc = crc_table[7][crc & 0xff]
+			^ crc_table[6][(crc >> 8) & 0xff]
+			^ crc_table[5][(crc >> 16) & 0xff]
+			^ crc_table[4][crc >> 24]
+			^ crc_table[3][buf[4]]
+			^ crc_table[2][buf[5]]
+			^ crc_table[1][buf[6]]
+			^ crc_table[0][buf[7]];
+	}
+	while (len--) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xff];
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	unsigned long long c;
+	uint64_t word;
+
+	for (; len > 0 && ((uintptr_t) buf & 7); len--) {
+		crc = __builtin_ia32_crc32qi(crc, *buf++);
+	}
+	c = crc;
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&word, buf, sizeof(word));
+		c = __builtin_ia32_crc32di(c, word);
+	}
+	crc = (uint32_t) c;
+	while (len--) {
+		crc = __builtin_ia32_crc32qi(crc, *buf++);
+	}
+	return crc;
+}
+#endif
+
+static void
+crc32c_setup(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		}
+		crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8)
+				^ crc_table[0][crc_table[j - 1][i] & 0xff];
+		}
+	}
+
+	crc_update = crc32c_sw;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc_update = crc32c_hw;
+	}
+#endif
+#ifdef DEBUG
+	fprintf(stderr, "crc32c: %s\n", crc_update == crc32c_sw ?
+			"slicing-by-8" : "sse4.2");
+#endif
+}
+
+void
+crc32c_init(void)
+{
+	pthread_once(&crc_once, crc32c_setup);
+}
+
+/*
+ * Extend crc, the CRC32C of what came before (0 to start), over len
+ * bytes.
+ */
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return ~crc_update(~crc, buf, len);
+}
+
+/*
+ * The CRC32C of a frame's header, for the payload to be added to.  Byte
+ * mode receivers start from this once they have the length, and carry
+ * it on over the data bytes as they come in.
+ */
+uint32_t
+fcs_header(int to, int from, int to_ring, int from_ring, int group, int length)
+{
+	unsigned char hdr[4 * ADDR_BYTES + 2];
+	int i;
+
+	for (i = 0; i < ADDR_BYTES; i++) {
+		hdr[i] = ADDR_BYTE(to, i);
+		hdr[ADDR_BYTES + i] = ADDR_BYTE(from, i);
+		hdr[2 * ADDR_BYTES + i] = ADDR_BYTE(to_ring, i);
+		hdr[3 * ADDR_BYTES + i] = ADDR_BYTE(from_ring, i);
+	}
+	hdr[4 * ADDR_BYTES] = group;
+	hdr[4 * ADDR_BYTES + 1] = length;
+
+	return crc32c(0, hdr, sizeof(hdr));
+}
+
+/*
+ * The FCS of a frame whose payload is at payload.
+ */
+uint32_t
+frame_fcs(const struct data_pkt *pkt, const char *payload)
+{
+	return crc32c(fcs_header(pkt->to, pkt->from, pkt->to_ring, pkt->from_ring,
+			pkt->to_group, pkt->length), payload, pkt->length);
+}
@@ -0,0 +1,403 @@
+/*
+ * Discrete-event engine (tokensim -e).
+ *
+ * Runs the same protocol as token_node() and send_pkt() on a single
+ * thread, from a priority queue of timestamped events, so a run takes
+ * no thread scheduling noise and is the same every time for a given
+ * seed.  Time is counted in link ticks: in byte mode one tick is one
+ * handoff of a byte from a node to the next.  With a link delay, and
+ * in frame mode, a tick is a byte time, in which every link moves one
+ * byte on.  A byte takes link_delay ticks to reach the next node, and a
+ * frame one: each node repeats a frame a byte behind it coming in, so
+ * its first byte is a hop a tick and its last follows its length in
+ * bytes behind.
+ *
+ * Rather than moving every byte the engine works out when each phase
+ * of a transmission happens:
+ *
+ *	token capture	the free token reaches a node with a frame
+ *			queued, at time t
+ *	header, data	carried round the ring to the destination
+ *	delivery	the last byte of the frame, its FCS, is in at
+ *			the destination, where it is counted as received
+ *	token release	the sender frees the queue slot and passes the
+ *			token on to the next node
+ *
+ * In byte mode only one byte is ever on the ring: the sender puts out
+ * the next byte of its frame each time the previous one has come all
+ * the way round, so byte k leaves at t + k * n_nodes.  A frame of
+ * length len is the flag, ADDR_BYTES of TO and of FROM, LEN, len data
+ * bytes and FCS_BYTES of FCS, followed by the token.
+ * With a link delay the ring is full of bytes, and the sender puts out
+ * one every tick in place of the fill coming in, so byte k leaves at
+ * t + k and takes n_nodes * link_delay ticks to come round.  Either
+ * way the sender frees the queue slot when its last FCS byte is back.
+ * In frame mode the frame of nbytes goes round once and the sender
+ * strips it when its last byte is back, at t + n_nodes + nbytes - 1.
+ * With early token release the token follows the last byte, so reaches
+ * the next node at t + nbytes + 1, and the strip only frees the queue
+ * slot.  The free token
+ * carries its priority and reservation from node to node as on the
+ * live ring; the reservations a frame picks up are worked out when it
+ * is back.  A multicast frame reaches each member of its group in
+ * turn.  With destination stripping the frame is done when it is all
+ * in at its destination, at t + dist + nbytes - 1, which sends the
+ * token on.
+ *
+ * The packet generator behaves as in runSimulation(): it fills in
+ * packets as fast as it can and stalls when the node it picked has a
+ * full transmit queue, until that node releases the token, or when the
+ * frame pool is empty, until any node does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "tokenRing.h"
+
+#define	EV_TOKEN	0	/* the free token reaches node	*/
+#define	EV_DELIVER	1	/* a frame's header reaches node	*/
+#define	EV_RELEASE	2	/* node is done sending		*/
+#define	EV_MCAST	3	/* a group frame's header reaches	*/
+				/* a member			*/
+
+struct des_event {
+	unsigned long long time;
+	unsigned long	seq;		/* breaks ties in insertion order */
+	int		type;
+	int		node;
+};
+
+struct des_queue {
+	struct des_event *heap;
+	unsigned long	len;
+	unsigned long	size;
+	unsigned long	seq;		/* events scheduled so far	*/
+};
+
+static int
+ev_before(const struct des_event *a, const struct des_event *b)
+{
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void
+des_schedule(struct des_queue *q, unsigned long long time, int type, int node)
+{
+	struct des_event ev;
+	unsigned long i, parent;
+
+	if (q->len == q->size) {
+		q->size = q->size ? 2 * q->size : 64;
+		q->heap = realloc(q->heap, q->size * sizeof(struct des_event));
+		if (!q->heap) {
+			panic("Failed to grow the event queue\n");
+		}
+	}
+
+	ev.time = time;
+	ev.seq = q->seq++;
+	ev.type = type;
+	ev.node = node;
+
+	for (i = q->len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!ev_before(&ev, &q->heap[parent]))
+			break;
+		q->heap[i] = q->heap[parent];
+	}
+	q->heap[i] = ev;
+}
+
+static int
+des_next(struct des_queue *q, struct des_event *ev)
+{
+	struct des_event last;
+	unsigned long i, child;
+
+	if (q->len == 0)
+		return 0;
+
+	*ev = q->heap[0];
+	last = q->heap[--q->len];
+	for (i = 0; (child = 2 * i + 1) < q->len; i = child) {
+		if (child + 1 < q->len && ev_before(&q->heap[child + 1], &q->heap[child]))
+			child++;
+		if (!ev_before(&q->heap[child], &last))
+			break;
+		q->heap[i] = q->heap[child];
+	}
+	q->heap[i] = last;
+	return 1;
+}
+
+/*
+ * Where the packet generator is up to.  Like runSimulation() it picks
+ * a node first and then waits for it, so a stall keeps the node.
+ */
+struct des_gen {
+	int		generated;
+	int		n_packets;
+	int		n_pending;	/* frames queued on all nodes	*/
+	int		stalled;	/* node waited on, or -1	*/
+	int		starved;	/* waiting for a pooled frame	*/
+};
+
+/*
+ * Run the packet generator until it has made all its packets or picks
+ * a node that is still busy.
+ */
+static void
+des_generate(struct TokenRingData *control, struct des_gen *gen)
+{
+	struct data_pkt *pkt;
+	int num;
+
+	gen->starved = 0;
+	while (gen->generated < gen->n_packets) {
+		num = gen->stalled >= 0 ? gen->stalled
+			: ring_random(control) % control->cfg.n_nodes;
+		if (control->shared_ptr->node[num].pending
+				== (int) control->cfg.txq_depth) {
+			control->shared_ptr->node[num].txq_full++;
+			gen->stalled = num;
+			return;
+		}
+		if ((pkt = pool_get(control->frames)) == NULL) {
+			gen->stalled = num;
+			gen->starved = 1;
+			return;
+		}
+		gen->stalled = -1;
+		generate_pkt(control, &control->rng, num, pkt);
+		TRACE(TR_QUEUE, num, pkt->length, 0, pkt->to);
+		tx_push(control, num, pkt);
+		gen->generated++;
+		gen->n_pending++;
+	}
+}
+
+/*
+ * Ticks a byte or frame takes from one node to the next, and between
+ * the bytes of a frame as the sender puts them out.
+ */
+static unsigned long long
+des_hop(struct TokenRingData *control)
+{
+	return control->cfg.link_delay ? control->cfg.link_delay : 1;
+}
+
+static unsigned long long
+des_gap(struct TokenRingData *control)
+{
+	return control->cfg.link_delay ? 1 : control->cfg.n_nodes;
+}
+
+/*
+ * Node num sends the frame at the head of its queue at time now, on the
+ * token it has just captured or is still holding.  Schedules the frame
+ * reaching its destination and the sender being done with it, and
+ * counts the handoffs it takes.
+ */
+static void
+des_send(struct TokenRingData *control, struct des_queue *q, int num,
+		unsigned long long now)
+{
+	struct node_data *node = &control->shared_ptr->node[num];
+	int n = control->cfg.n_nodes;
+	struct data_pkt *pkt;
+	int dist, nbytes, i;
+	unsigned long long rx, done, at, hop = des_hop(control), gap = des_gap(control);
+
+	pkt = tx_start(control, num);
+	dist = (pkt->to - num + n) % n;
+	nbytes = 1 + 2 * ADDR_BYTES + 1 + pkt->length + FCS_BYTES;
+	if (control->cfg.dest_strip) {
+		// the destination takes it off and frees the token
+		rx = done = now + dist + nbytes - 1;
+		node->xfers += dist;
+		node->state.in_flight = 1;
+		node->state.held = 0;
+		if (!control->cfg.etr) {
+			control->shared_ptr->node[pkt->to].idle++;
+			control->shared_ptr->node[pkt->to].xfers++;
+			des_schedule(q, rx + 1, EV_TOKEN, (pkt->to + 1) % n);
+		}
+	} else if (control->cfg.xfer_mode == XFER_FRAME) {
+		// the last byte is a frame's length behind the first
+		rx = now + dist + nbytes - 1;
+		done = now + n + nbytes - 1;
+		node->xfers += n;
+	} else {
+		// received once its FCS is in
+		rx = now + (nbytes - 1) * gap + dist * hop;
+		done = now + (nbytes - 1) * gap + n * hop;
+		// and the token behind it, all the way round
+		node->xfers += (long long) (nbytes + 1) * n;
+	}
+	TRACE(TR_FRAME_START, num, pkt->length, 0, pkt->to);
+	if (pkt->to_group) {
+		// every member copies it on the way round
+		for (i = (num + 1) % n; i != num; i = (i + 1) % n) {
+			if (mcast_member(control, pkt->to, i)) {
+				at = rx + ((i - num + n) % n - dist) * hop;
+				des_schedule(q, at, EV_MCAST, i);
+				if (control->cfg.latency) {
+					hist_record(&control->shared_ptr->node[i].lat[LAT_DELIVERY],
+							at - pkt->queued_at);
+				}
+			}
+		}
+	} else {
+		des_schedule(q, rx, EV_DELIVER, pkt->to);
+		if (control->cfg.latency) {
+			hist_record(&control->shared_ptr->node[pkt->to].lat[LAT_DELIVERY],
+					rx - pkt->queued_at);
+		}
+	}
+	des_schedule(q, done, EV_RELEASE, num);
+	if (control->cfg.etr) {
+		node->state.in_flight = 1;
+		node->state.held = 0;
+		node->idle++;
+		node->xfers++;
+		// right behind the frame's last byte
+		des_schedule(q, now + nbytes + 1, EV_TOKEN, (num + 1) % n);
+	}
+}
+
+/*
+ * The reservation a frame from node num has picked up by the time it is
+ * back: the highest priority queued at any other node.  The queues only
+ * change when the generator runs, at releases, so they are still as the
+ * frame found them on its way round.
+ */
+static int
+des_reservation(struct TokenRingData *control, int num)
+{
+	int i, p, res = 0;
+
+	for (i = 0; i < control->cfg.n_nodes; i++) {
+		if (i != num && (p = tx_prio_pending(control, i)) > res) {
+			res = p;
+		}
+	}
+	return res;
+}
+
+int
+des_run(struct TokenRingData *control, int numPackets)
+{
+	struct des_queue q = { NULL, 0, 0, 0 };
+	struct des_event ev;
+	struct node_data *node = control->shared_ptr->node;
+	int n = control->cfg.n_nodes;
+	struct des_gen gen = { 0, numPackets, 0, -1, 0 };
+	struct data_pkt token;
+	unsigned long long now = 0, hop = des_hop(control);
+	// virtual clock time of a tick
+	unsigned long long tick_ps = control->cfg.byte_ps
+		+ (control->cfg.link_delay ? 0 : control->cfg.prop_ps);
+	long long fill;
+	int i, res = 0;
+
+	control->des_now = 0;
+	if (control->cfg.rot_interval && rotation_start(control) < 0) {
+		return -1;
+	}
+	des_generate(control, &gen);
+
+	// node #0 puts the first token on the ring
+	token_release(control, 0, 0, &token);
+	node[0].idle++;
+	node[0].xfers++;
+	des_schedule(&q, hop, EV_TOKEN, 1 % n);
+
+	while (des_next(&q, &ev)) {
+		now = control->des_now = ev.time;
+		if (control->rotation) {
+			rotation_tick(control, now);
+		}
+		switch (ev.type) {
+		case EV_TOKEN:
+			node[ev.node].vnow = now * tick_ps;
+			if (node[ev.node].state.held) {
+				// byte mode: our own token is back behind our frame
+				if (tx_more(control, ev.node)) {
+					des_send(control, &q, ev.node, now);
+					break;
+				}
+				node[ev.node].state.held = 0;
+			} else if (!node[ev.node].state.in_flight
+					&& token_capture(control, ev.node, &token)) {
+				// capture the token and send the head of the queue
+				token_seen(control, ev.node, 1);
+				des_send(control, &q, ev.node, now);
+				break;
+			} else {
+				token_seen(control, ev.node, 0);
+			}
+			if (gen.generated == gen.n_packets && gen.n_pending == 0) {
+				// nothing left to send: the run is over
+				break;
+			}
+			node[ev.node].idle++;
+			node[ev.node].xfers++;
+			des_schedule(&q, now + hop, EV_TOKEN, (ev.node + 1) % n);
+			break;
+
+		case EV_DELIVER:
+			node[ev.node].received++;
+			break;
+
+		case EV_MCAST:
+			node[ev.node].received++;
+			node[ev.node].mcast_received++;
+			break;
+
+		case EV_RELEASE:
+			// free the queue slot, then send on or give up the token
+			if (control->cfg.n_prio > 1) {
+				res = des_reservation(control, ev.node);
+			}
+			tx_pop(control, ev.node);
+			gen.n_pending--;
+			if (gen.stalled == ev.node || gen.starved) {
+				des_generate(control, &gen);
+			}
+			if (control->cfg.etr || control->cfg.dest_strip) {
+				node[ev.node].state.in_flight = 0;
+			} else if (control->cfg.xfer_mode != XFER_FRAME) {
+				// the token follows the last byte round to us
+				des_schedule(&q, now + des_gap(control), EV_TOKEN, ev.node);
+			} else if (tx_more(control, ev.node)) {
+				// the next frame goes out in place of this one
+				des_send(control, &q, ev.node, now);
+			} else {
+				token_release(control, ev.node, res, &token);
+				node[ev.node].idle++;
+				node[ev.node].xfers++;
+				des_schedule(&q, now + 1, EV_TOKEN, (ev.node + 1) % n);
+			}
+			break;
+		}
+	}
+
+	if (control->cfg.link_delay) {
+		// every node handed on a byte each tick, fill where it had
+		// nothing else to send
+		fill = (long long) n * now;
+		for (i = 0; i < n; i++) {
+			fill -= node[i].xfers;
+		}
+		for (i = 0; fill > 0 && i < n; i++) {
+			node[i].xfers += fill / n + (i < fill % n);
+			node[i].idle += fill / n + (i < fill % n);
+		}
+	}
+
+	rotation_stop(control);
+
+	printf("des: %d packets on %d nodes in %llu ticks, %lu events\n",
+			gen.generated, n, now, q.seq);
+	free(q.heap);
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Log-bucketed latency histograms, in the manner of HdrHistogram.
+ *
+ * Values below HIST_SUB each have a bucket of their own.  Above that
+ * every power of two is split into HIST_SUB buckets of equal width, so
+ * a bucket is never wider than 1 / HIST_SUB of the values in it and a
+ * percentile read back from one is good to about 6%.  Recording is a
+ * count leading zeros, a shift and an increment, with no locks: each
+ * histogram has one writer, the node it belongs to, and they are only
+ * merged once the nodes have stopped.
+ */
+#include <string.h>
+#include "tokenRing.h"
+
+static unsigned
+hist_bucket(unsigned long long v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return (unsigned) v;
+	e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB
+		+ (unsigned) ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * The middle of the values that go in bucket b.
+ */
+static unsigned long long
+hist_value(unsigned b)
+{
+	unsigned e = b / HIST_SUB + HIST_SUB_BITS - 1;
+
+	if (b < HIST_SUB)
+		return b;
+	return ((unsigned long long) (HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS))
+		+ ((1ULL << (e - HIST_SUB_BITS)) >> 1);
+}
+
+void
+hist_record(struct hist *h, unsigned long long v)
+{
+	h->buckets[hist_bucket(v)]++;
+	if (h->count++ == 0 || v < h->min)
+		h->min = v;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+void
+hist_merge(struct hist *dst, const struct hist *src)
+{
+	unsigned b;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		dst->buckets[b] += src->buckets[b];
+	if (src->count && (dst->count == 0 || src->min < dst->min))
+		dst->min = src->min;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/*
+ * The value pct percent of the recorded values are at or below, to the
+ * resolution of a bucket, and never more than the largest recorded.
+ */
+unsigned long long
+hist_percentile(const struct hist *h, double pct)
+{
+	unsigned long long want, seen = 0, v;
+	unsigned b;
+
+	if (h->count == 0)
+		return 0;
+	want = (unsigned long long) (pct / 100.0 * h->count + 0.5);
+	if (want < 1)
+		want = 1;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		if ((seen += h->buckets[b]) >= want)
+			break;
+	}
+	v = hist_value(b);
+	return v < h->max ? v : h->max;
+}
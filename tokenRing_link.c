@@ -0,0 +1,212 @@
+/*
+ * Single-producer/single-consumer link buffers.
+ *
+ * Every link on the ring has exactly one writer (the upstream node) and
+ * one reader (the node the link belongs to), so a ring buffer indexed by
+ * two free running counters is enough: the writer owns tail, the reader
+ * owns head, and each side only ever reads the other's counter.  The two
+ * counters live on separate cache lines so that the writer filling a
+ * slot does not keep stealing the line the reader is polling.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "tokenRing.h"
+
+/*
+ * Set up a link holding depth elements of elem_size bytes.  The depth is
+ * rounded up to a power of two so the slot index is a mask of the
+ * counter.
+ */
+int
+spsc_link_init(struct spsc_link *link, unsigned depth, size_t elem_size)
+{
+	unsigned size = 1;
+
+	while (size < depth)
+		size <<= 1;
+
+	link->buf = malloc((size_t) size * elem_size);
+	if (!link->buf) {
+		fprintf(stderr, "Failed to allocate link buffer\n");
+		return -1;
+	}
+	link->mask = size - 1;
+	link->elem_size = elem_size;
+	atomic_init(&link->head, 0);
+	atomic_init(&link->tail, 0);
+	link->cached_head = 0;
+	link->cached_tail = 0;
+	if (wait_event_init(&link->data_ev) < 0)
+		return -1;
+	if (wait_event_init(&link->space_ev) < 0) {
+		wait_event_destroy(&link->data_ev);
+		return -1;
+	}
+	return 0;
+}
+
+void
+spsc_link_destroy(struct spsc_link *link)
+{
+	if (link->buf) {
+		wait_event_destroy(&link->data_ev);
+		wait_event_destroy(&link->space_ev);
+	}
+	free(link->buf);
+	link->buf = NULL;
+}
+
+/*
+ * Non-blocking halves of the protocol.  The writer asks for a slot,
+ * fills it in place and publishes it; the reader asks for the oldest
+ * slot, copies it out and releases it.  The acquire/release pairs on
+ * head and tail are what order the slot contents.
+ */
+void *
+spsc_try_write_slot(struct spsc_link *link)
+{
+	unsigned tail = atomic_load_explicit(&link->tail, memory_order_relaxed);
+
+	if (tail - link->cached_head > link->mask) {
+		link->cached_head = atomic_load_explicit(&link->head,
+				memory_order_acquire);
+		if (tail - link->cached_head > link->mask)
+			return NULL;
+	}
+	return link->buf + (size_t) (tail & link->mask) * link->elem_size;
+}
+
+/*
+ * Whether the writer could publish n more elements without waiting.
+ */
+int
+spsc_has_room(struct spsc_link *link, unsigned n)
+{
+	unsigned tail = atomic_load_explicit(&link->tail, memory_order_relaxed);
+
+	if (tail + n - 1 - link->cached_head > link->mask) {
+		link->cached_head = atomic_load_explicit(&link->head,
+				memory_order_acquire);
+		if (tail + n - 1 - link->cached_head > link->mask)
+			return 0;
+	}
+	return 1;
+}
+
+void
+spsc_publish(struct spsc_link *link)
+{
+	unsigned tail = atomic_load_explicit(&link->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&link->tail, tail + 1, memory_order_release);
+}
+
+void *
+spsc_try_read_slot(struct spsc_link *link)
+{
+	unsigned head = atomic_load_explicit(&link->head, memory_order_relaxed);
+
+	if (head == link->cached_tail) {
+		link->cached_tail = atomic_load_explicit(&link->tail,
+				memory_order_acquire);
+		if (head == link->cached_tail)
+			return NULL;
+	}
+	return link->buf + (size_t) (head & link->mask) * link->elem_size;
+}
+
+void
+spsc_release(struct spsc_link *link)
+{
+	unsigned head = atomic_load_explicit(&link->head, memory_order_relaxed);
+
+	atomic_store_explicit(&link->head, head + 1, memory_order_release);
+}
+
+/*
+ * Blocking versions used by the node threads.  They wait with the
+ * configured strategy while the other side catches up, and give up
+ * (returning NULL) once the simulation is being torn down.  Publishing
+ * and releasing signal the other side's event.
+ *
+ * When the nodes are tasks on a worker pool nothing ever waits here: a
+ * task is only run once its inbound link has data and its outbound
+ * link has room, and publishing or releasing makes the task on the
+ * other side runnable instead of signalling it.
+ */
+void *
+spsc_write_slot(struct TokenRingData *control, int node)
+{
+	struct spsc_link *link = &control->links[node];
+	void *slot;
+	unsigned key;
+
+	if (control->sched)
+		return spsc_try_write_slot(link);
+	while ((slot = spsc_try_write_slot(link)) == NULL) {
+		key = wait_event_prepare(&link->space_ev);
+		if ((slot = spsc_try_write_slot(link)) != NULL)
+			break;
+		if (atomic_load_explicit(&control->shared_ptr->cleanup_in_progress,
+				memory_order_relaxed))
+			return NULL;
+		wait_event_wait(&link->space_ev, key, control->cfg.wait_strategy);
+	}
+	return slot;
+}
+
+void *
+spsc_read_slot(struct TokenRingData *control, int node)
+{
+	struct spsc_link *link = &control->links[node];
+	void *slot;
+	unsigned key;
+
+	if (control->sched)
+		return spsc_try_read_slot(link);
+	while ((slot = spsc_try_read_slot(link)) == NULL) {
+		key = wait_event_prepare(&link->data_ev);
+		if ((slot = spsc_try_read_slot(link)) != NULL)
+			break;
+		if (atomic_load_explicit(&control->shared_ptr->cleanup_in_progress,
+				memory_order_relaxed))
+			return NULL;
+		wait_event_wait(&link->data_ev, key, control->cfg.wait_strategy);
+	}
+	return slot;
+}
+
+void
+spsc_write_done(struct TokenRingData *control, int node)
+{
+	struct spsc_link *link = &control->links[node];
+
+	spsc_publish(link);
+	if (control->sched)
+		sched_wake(control, node);
+	else
+		wait_event_signal(&link->data_ev, control->cfg.wait_strategy);
+}
+
+void
+spsc_read_done(struct TokenRingData *control, int node)
+{
+	struct spsc_link *link = &control->links[node];
+
+	spsc_release(link);
+	if (control->sched)
+		sched_link_released(control, node);
+	else
+		wait_event_signal(&link->space_ev, control->cfg.wait_strategy);
+}
+
+/*
+ * Kick both ends of a link, used at shutdown so that nobody stays
+ * parked after cleanup_in_progress has been raised.
+ */
+void
+spsc_link_wake(struct spsc_link *link, int strategy)
+{
+	wait_event_signal(&link->data_ev, strategy);
+	wait_event_signal(&link->space_ev, strategy);
+}
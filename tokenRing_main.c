@@ -15,19 +15,103 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
 
 #include "tokenRing.h"
 
 void
 printHelp(const char *progname)
 {
-	fprintf(stderr, "%s <nPackets>\n", progname);
+	fprintf(stderr, "%s [-DefHptz] [-n nodes] [-l sem|spsc] [-d depth] [-y delay] "
+			"[-w block|spin|spinpark|futex] [-m workers] [-s seed] "
+			"[-r rings] [-L length] [-q depth] [-b frames] [-g generators] "
+			"[-T frames|<bytes>b] [-P levels] [-G groups] [-M percent] "
+			"[-B Mb/s] [-X ns] [-R interval] [-o file] "
+			"<nPackets>\n", progname);
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Simulates a token ring network with %d machines,\n",
-			N_NODES);
+	fprintf(stderr, "Simulates a token ring network with <nodes> machines\n");
+	fprintf(stderr, "(%d by default, up to %d),\n", N_NODES_DEFAULT, MAX_NODES);
 	fprintf(stderr, "sending <nPackets> randomly generated packets on the\n");
 	fprintf(stderr, "network before exitting and printing statistics\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "    -n  number of nodes on the ring\n");
+	fprintf(stderr, "    -f  frame mode: pass whole frames between nodes\n");
+	fprintf(stderr, "        instead of one byte at a time\n");
+	fprintf(stderr, "    -t  early token release: send a free token right\n");
+	fprintf(stderr, "        after each frame; needs -f\n");
+	fprintf(stderr, "    -T  token holding time: send up to this many\n");
+	fprintf(stderr, "        frames (1), or with a b suffix payload bytes,\n");
+	fprintf(stderr, "        per token capture, and report utilisation\n");
+	fprintf(stderr, "        and fairness; only 1 with -t\n");
+	fprintf(stderr, "    -P  access priorities, 1 to %d (1): frames get a\n",
+			MAX_PRIO);
+	fprintf(stderr, "        random one, and tokens a priority and a\n");
+	fprintf(stderr, "        reservation; needs -f, not with -t\n");
+	fprintf(stderr, "    -D  destination stripping: the destination takes\n");
+	fprintf(stderr, "        frames off the ring and frees the token;\n");
+	fprintf(stderr, "        with -t, spatial reuse; needs -f, not with\n");
+	fprintf(stderr, "        -T, -P or -r\n");
+	fprintf(stderr, "    -G  multicast groups, 1 to %d: group %d is every\n",
+			MAX_GROUPS, BROADCAST_GROUP);
+	fprintf(stderr, "        node, and each node joins each of the others\n");
+	fprintf(stderr, "        at random; not with -D\n");
+	fprintf(stderr, "    -M  percentage of frames sent to a random group\n");
+	fprintf(stderr, "        (%d); -M alone sets up the broadcast group\n",
+			MCAST_PCT_DEFAULT);
+	fprintf(stderr, "    -z  zero-copy: frames carry a reference to the\n");
+	fprintf(stderr, "        sender's payload instead of the data; needs -f\n");
+	fprintf(stderr, "    -l  link implementation: sem (EMPTY/FILLED\n");
+	fprintf(stderr, "        semaphores, the default) or spsc (lock-free\n");
+	fprintf(stderr, "        ring buffer)\n");
+	fprintf(stderr, "    -d  depth of each link in elements (%d, or one\n",
+			LINK_DEPTH_DEFAULT);
+	fprintf(stderr, "        more than -y)\n");
+	fprintf(stderr, "    -y  link delay in byte times (0): each link holds\n");
+	fprintf(stderr, "        this many bytes, fill when idle, and a sender\n");
+	fprintf(stderr, "        streams its frame; 0 has one byte on the ring;\n");
+	fprintf(stderr, "        not with -f\n");
+	fprintf(stderr, "    -q  frames each node can have queued to send (%d)\n",
+			TXQ_DEPTH_DEFAULT);
+	fprintf(stderr, "    -b  frames in the pool the transmit queues draw\n");
+	fprintf(stderr, "        from (enough to fill them all by default)\n");
+	fprintf(stderr, "    -w  how spsc links wait: block (semaphore, the\n");
+	fprintf(stderr, "        default), spin (busy-poll), spinpark (spin,\n");
+	fprintf(stderr, "        then futex) or futex\n");
+	fprintf(stderr, "    -m  run the nodes as tasks on this many worker\n");
+	fprintf(stderr, "        threads (0 for one per core) instead of a\n");
+	fprintf(stderr, "        thread per node; uses spsc links, and -w\n");
+	fprintf(stderr, "        then says how idle workers wait\n");
+	fprintf(stderr, "    -e  run the single threaded discrete-event engine\n");
+	fprintf(stderr, "        instead of a live ring\n");
+	fprintf(stderr, "    -s  seed for the packet generator (the time of\n");
+	fprintf(stderr, "        day by default)\n");
+	fprintf(stderr, "    -L  longest payload to generate, 1 to %d (%d)\n",
+			MAX_DATA, MAX_DATA);
+	fprintf(stderr, "    -g  packet generator threads, each feeding its\n");
+	fprintf(stderr, "        own share of the nodes (1)\n");
+	fprintf(stderr, "    -r  run a campus of this many rings (up to %d),\n",
+			MAX_RINGS);
+	fprintf(stderr, "        joined by bridges at node %d, each sending\n",
+			BRIDGE_NODE);
+	fprintf(stderr, "        <nPackets>; needs -f\n");
+	fprintf(stderr, "    -B  virtual clock: report simulated time, payload\n");
+	fprintf(stderr, "        throughput and token rotation for a ring of\n");
+	fprintf(stderr, "        this line rate; in byte mode -y defaults to\n");
+	fprintf(stderr, "        enough bytes to fill each link\n");
+	fprintf(stderr, "    -X  propagation delay of each link in ns (0); needs\n");
+	fprintf(stderr, "        -B, and not with -e -f\n");
+	fprintf(stderr, "    -H  report queueing, access and delivery latency\n");
+	fprintf(stderr, "        percentiles for each node and the ring\n");
+	fprintf(stderr, "    -R  report token rotation times, and a series of\n");
+	fprintf(stderr, "        them sampled this often, in us, or ticks\n");
+	fprintf(stderr, "        with -e (%d)\n", ROT_INTERVAL_DEFAULT);
+	fprintf(stderr, "    -o  write the rotation times to this file as\n");
+	fprintf(stderr, "        JSON; implies -R\n");
+	fprintf(stderr, "    -p  report cache and context switch counters\n");
+	fprintf(stderr, "\n");
 }
 
 /**
@@ -39,22 +123,410 @@ main(argc, argv)
 	int argc;
 	const char **argv;
 {
-	int numPackets;
+	int numPackets, ch, link_given = 0, depth_given = 0, delay_given = 0;
+	double prop_ns = -1, rot_interval = 0;
+	unsigned tht;
+	char unit;
 	TokenRingData *simulationData;
+	struct TokenRingConfig cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.n_nodes = N_NODES_DEFAULT;
+	cfg.xfer_mode = XFER_BYTE;
+	cfg.link_type = LINK_SEM;
+	cfg.link_depth = LINK_DEPTH_DEFAULT;
+	cfg.txq_depth = TXQ_DEPTH_DEFAULT;
+	cfg.wait_strategy = WAIT_BLOCK;
+	cfg.seed = (unsigned) time(0);
+	cfg.n_rings = 1;
+	cfg.generators = 1;
+	cfg.max_len = MAX_DATA;
+	cfg.tht_frames = 1;
+	cfg.n_prio = 1;
+	cfg.mcast_pct = -1;
+
+	while ((ch = getopt(argc, (char * const *) argv, "DefHtzn:l:d:y:q:b:w:m:ps:r:g:L:T:P:G:M:B:X:R:o:")) != -1) {
+		switch (ch) {
+		case 'n':
+			if (sscanf(optarg, "%d", &cfg.n_nodes) != 1
+					|| cfg.n_nodes < 2 || cfg.n_nodes > MAX_NODES) {
+				fprintf(stderr, "Cannot parse number of nodes from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'f':
+			cfg.xfer_mode = XFER_FRAME;
+			break;
+		case 't':
+			cfg.etr = 1;
+			break;
+		case 'D':
+			cfg.dest_strip = 1;
+			break;
+		case 'H':
+			cfg.latency = 1;
+			break;
+		case 'z':
+			cfg.zero_copy = 1;
+			break;
+		case 'p':
+			cfg.perf = 1;
+			break;
+		case 'e':
+			cfg.des = 1;
+			break;
+		case 'r':
+			if (sscanf(optarg, "%d", &cfg.n_rings) != 1
+					|| cfg.n_rings < 1 || cfg.n_rings > MAX_RINGS) {
+				fprintf(stderr, "Cannot parse number of rings from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 's':
+			if (sscanf(optarg, "%u", &cfg.seed) != 1) {
+				fprintf(stderr, "Cannot parse seed from '%s'\n", optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'l':
+			if (strcmp(optarg, "sem") == 0) {
+				cfg.link_type = LINK_SEM;
+			} else if (strcmp(optarg, "spsc") == 0) {
+				cfg.link_type = LINK_SPSC;
+			} else {
+				fprintf(stderr, "Unknown link type '%s'\n", optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			link_given = 1;
+			break;
+		case 'd':
+			if (sscanf(optarg, "%u", &cfg.link_depth) != 1
+					|| cfg.link_depth < 1 || cfg.link_depth > SEM_VALUE_MAX) {
+				fprintf(stderr, "Cannot parse link depth from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			depth_given = 1;
+			break;
+		case 'y':
+			if (sscanf(optarg, "%u", &cfg.link_delay) != 1
+					|| cfg.link_delay >= SEM_VALUE_MAX) {
+				fprintf(stderr, "Cannot parse link delay from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			delay_given = 1;
+			break;
+		case 'B':
+			if (sscanf(optarg, "%lf", &cfg.line_rate) != 1
+					|| !(cfg.line_rate > 0 && cfg.line_rate <= 1e6)) {
+				fprintf(stderr, "Cannot parse line rate from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'X':
+			if (sscanf(optarg, "%lf", &prop_ns) != 1
+					|| !(prop_ns >= 0 && prop_ns <= 1e9)) {
+				fprintf(stderr, "Cannot parse propagation delay from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'R':
+			if (sscanf(optarg, "%lf", &rot_interval) != 1
+					|| !(rot_interval > 0 && rot_interval <= 1e9)) {
+				fprintf(stderr, "Cannot parse rotation sample interval "
+						"from '%s'\n", optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'o':
+			cfg.rot_file = optarg;
+			break;
+		case 'q':
+			if (sscanf(optarg, "%u", &cfg.txq_depth) != 1
+					|| cfg.txq_depth < 1 || cfg.txq_depth > SEM_VALUE_MAX) {
+				fprintf(stderr, "Cannot parse transmit queue depth from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'b':
+			if (sscanf(optarg, "%u", &cfg.pool_frames) != 1
+					|| cfg.pool_frames < 1 || cfg.pool_frames > INT_MAX) {
+				fprintf(stderr, "Cannot parse frame pool size from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'L':
+			if (sscanf(optarg, "%d", &cfg.max_len) != 1
+					|| cfg.max_len < 1 || cfg.max_len > MAX_DATA) {
+				fprintf(stderr, "Cannot parse payload length from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'T':
+			unit = '\0';
+			if (sscanf(optarg, "%u%c", &tht, &unit) < 1 || tht < 1
+					|| tht > INT_MAX || (unit != '\0' && unit != 'b')) {
+				fprintf(stderr, "Cannot parse token holding time from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			// a byte limit lets through as many frames as fit
+			cfg.tht_frames = unit == 'b' ? 0 : tht;
+			cfg.tht_bytes = unit == 'b' ? tht : 0;
+			cfg.tht_report = 1;
+			break;
+		case 'P':
+			if (sscanf(optarg, "%d", &cfg.n_prio) != 1
+					|| cfg.n_prio < 1 || cfg.n_prio > MAX_PRIO) {
+				fprintf(stderr, "Cannot parse priority levels from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'G':
+			if (sscanf(optarg, "%d", &cfg.n_groups) != 1
+					|| cfg.n_groups < 1 || cfg.n_groups > MAX_GROUPS) {
+				fprintf(stderr, "Cannot parse multicast groups from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'M':
+			if (sscanf(optarg, "%d", &cfg.mcast_pct) != 1
+					|| cfg.mcast_pct < 0 || cfg.mcast_pct > 100) {
+				fprintf(stderr, "Cannot parse multicast percentage from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'g':
+			if (sscanf(optarg, "%d", &cfg.generators) != 1
+					|| cfg.generators < 1) {
+				fprintf(stderr, "Cannot parse number of generators from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'w':
+			if ((cfg.wait_strategy = wait_strategy_from_name(optarg)) < 0) {
+				fprintf(stderr, "Unknown wait strategy '%s'\n", optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'm':
+			if (sscanf(optarg, "%d", &cfg.workers) != 1
+					|| cfg.workers < 0) {
+				fprintf(stderr, "Cannot parse number of workers from '%s'\n",
+						optarg);
+				printHelp(argv[0]);
+				exit(1);
+			}
+			if (cfg.workers == 0
+					&& (cfg.workers = (int) sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+				cfg.workers = 1;
+			}
+			break;
+		default:
+			printHelp(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (cfg.n_rings > 1 && (cfg.des || cfg.xfer_mode != XFER_FRAME)) {
+		fprintf(stderr, "Only frame mode carries ring numbers; "
+				"run a campus with -f and without -e\n");
+		exit(1);
+	}
+
+	if (cfg.zero_copy && cfg.xfer_mode != XFER_FRAME) {
+		fprintf(stderr, "Byte mode sends the payload itself; "
+				"use -z with -f\n");
+		exit(1);
+	}
+
+	if (cfg.etr && cfg.xfer_mode != XFER_FRAME) {
+		fprintf(stderr, "Byte mode releases the token behind the frame; "
+				"use -t with -f\n");
+		exit(1);
+	}
+
+	if (prop_ns >= 0 && cfg.line_rate == 0) {
+		fprintf(stderr, "A propagation delay needs a line rate; "
+				"use -X with -B\n");
+		exit(1);
+	}
+
+	if (cfg.rot_file && rot_interval == 0) {
+		rot_interval = ROT_INTERVAL_DEFAULT;
+	}
+	if (rot_interval > 0) {
+		// ring_now() units: ns live, ticks under -e
+		cfg.rot_interval = cfg.des ? (unsigned long long) (rot_interval + 0.5)
+			: (unsigned long long) (rot_interval * 1e3 + 0.5);
+		if (cfg.rot_interval == 0) {
+			cfg.rot_interval = 1;
+		}
+	}
 
-	if (argc < 2) {
+	if (cfg.line_rate > 0) {
+		if (cfg.des && cfg.xfer_mode != XFER_BYTE && prop_ns > 0) {
+			fprintf(stderr, "Discrete-event frame mode has no "
+					"propagation delay; use -X -e without -f\n");
+			exit(1);
+		}
+		// eight bits at line_rate Mb/s, in ps
+		cfg.byte_ps = (unsigned long long) (8e6 / cfg.line_rate + 0.5);
+		cfg.prop_ps = prop_ns > 0 ? (unsigned long long) (prop_ns * 1e3 + 0.5) : 0;
+		if (cfg.byte_ps == 0) {
+			cfg.byte_ps = 1;
+		}
+		// a link holds as many bytes as are on the wire at once
+		if (cfg.xfer_mode == XFER_BYTE && !delay_given) {
+			if ((cfg.prop_ps + cfg.byte_ps - 1) / cfg.byte_ps
+					>= SEM_VALUE_MAX - 1) {
+				fprintf(stderr, "Links of %g ns hold too many bytes; "
+						"set -y\n", prop_ns);
+				exit(1);
+			}
+			cfg.link_delay = (unsigned) ((cfg.byte_ps + cfg.prop_ps
+					+ cfg.byte_ps - 1) / cfg.byte_ps);
+		}
+	}
+
+	if (cfg.link_delay && cfg.xfer_mode != XFER_BYTE) {
+		fprintf(stderr, "Link delay is in byte times; use -y without -f\n");
+		exit(1);
+	}
+
+	// a link needs a free slot beyond the bytes always on it
+	if (cfg.link_delay >= cfg.link_depth) {
+		if (depth_given) {
+			fprintf(stderr, "A link delay of %u needs links of depth "
+					"%u or more\n", cfg.link_delay, cfg.link_delay + 1);
+			exit(1);
+		}
+		cfg.link_depth = cfg.link_delay + 1;
+	}
+
+	if (cfg.n_prio > 1 && cfg.xfer_mode != XFER_FRAME) {
+		fprintf(stderr, "Only frame mode carries priorities; "
+				"use -P with -f\n");
+		exit(1);
+	}
+
+	if (cfg.n_prio > 1 && cfg.etr) {
+		fprintf(stderr, "Early token release leaves no frame to reserve "
+				"the next token in; use -P without -t\n");
+		exit(1);
+	}
+
+	if (cfg.mcast_pct < 0) {
+		cfg.mcast_pct = MCAST_PCT_DEFAULT;
+	} else if (cfg.n_groups == 0) {
+		cfg.n_groups = 1;
+	}
+
+	if (cfg.dest_strip && cfg.n_groups > 0) {
+		fprintf(stderr, "Multicast frames go round to their sender; "
+				"use -G without -D\n");
+		exit(1);
+	}
+
+	if (cfg.dest_strip && (cfg.xfer_mode != XFER_FRAME || cfg.n_rings > 1
+			|| cfg.n_prio > 1 || cfg.tht_frames != 1 || cfg.tht_bytes)) {
+		fprintf(stderr, "Destination stripping needs -f, and the token "
+				"goes on from the destination; use -D without -T, -P or -r\n");
+		exit(1);
+	}
+
+	if (cfg.etr && (cfg.tht_frames != 1 || cfg.tht_bytes)) {
+		fprintf(stderr, "Early token release sends one frame per token; "
+				"use -T 1 with -t\n");
+		exit(1);
+	}
+
+	if (cfg.des && cfg.workers > 0) {
+		fprintf(stderr, "The discrete-event engine has no worker pool\n");
+		exit(1);
+	}
+
+	if (cfg.des && cfg.generators > 1) {
+		fprintf(stderr, "The discrete-event engine has one packet generator\n");
+		exit(1);
+	}
+
+	if (cfg.generators > cfg.n_nodes) {
+		fprintf(stderr, "Cannot split %d nodes between %d generators\n",
+				cfg.n_nodes, cfg.generators);
+		exit(1);
+	}
+
+	if (cfg.workers > 0) {
+		if (link_given && cfg.link_type != LINK_SPSC) {
+			fprintf(stderr, "The worker pool only runs on spsc links\n");
+			exit(1);
+		}
+		cfg.link_type = LINK_SPSC;
+		// a task only runs with room for a frame and the token behind it
+		if (cfg.etr && cfg.link_depth < 2) {
+			cfg.link_depth = 2;
+		}
+	}
+
+	if (cfg.link_type == LINK_SEM && cfg.wait_strategy != WAIT_BLOCK) {
+		fprintf(stderr, "Semaphore links can only block; "
+				"use -l spsc with -w %s\n",
+				wait_strategy_name(cfg.wait_strategy));
+		exit(1);
+	}
+
+	if (optind >= argc) {
 		printHelp(argv[0]);
 		exit(1);
 	}
 
-	if (sscanf(argv[1], "%d", &numPackets) != 1) {
+	if (sscanf(argv[optind], "%d", &numPackets) != 1) {
 		fprintf(stderr, "Cannot parse number of packets from '%s'\n",
-				argv[1]);
+				argv[optind]);
 		printHelp(argv[0]);
 		exit(1);
 	}
 
-	if (( simulationData = setupSystem()) == NULL) {
+	if (cfg.n_rings > 1) {
+		if (campus_run(&cfg, numPackets) < 0) {
+			fprintf(stderr, "Campus failed\n");
+			exit(1);
+		}
+		exit(0);
+	}
+
+	if (( simulationData = setupSystem(&cfg)) == NULL) {
 		fprintf(stderr, "Setup failed\n");
 		printHelp(argv[0]);
 		exit(1);
@@ -0,0 +1,163 @@
+/*
+ * Hardware performance counters around a simulation run (tokensim -p).
+ *
+ * The counters are opened on the main thread with inherit set before
+ * the node threads are created, so the threads' counts are folded in
+ * as they exit.  Counters the machine or the kernel will not give us
+ * (virtual machines often hide the hardware ones) are reported as n/a
+ * rather than failing the run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "tokenRing.h"
+
+#define	PERF_CACHE_REFS		0
+#define	PERF_CACHE_MISSES	1
+#define	PERF_L1D_MISSES		2
+#define	PERF_CTX_SWITCHES	3
+#define	PERF_NUM		4
+
+struct perf_counters {
+	int		fd[PERF_NUM];
+	uint64_t	value[PERF_NUM];
+	struct timespec	start;
+	double		seconds;
+};
+
+static const struct {
+	const char	*name;
+	uint32_t	type;
+	uint64_t	config;
+} perf_events[PERF_NUM] = {
+	{ "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+	{ "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "L1-dcache-load-misses", PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_L1D
+		| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static int
+perf_open(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	// context switches are counted by the kernel itself
+	if (type != PERF_TYPE_SOFTWARE) {
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+	}
+
+	return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Open and start the counters.  Must be called before the node
+ * threads are created.
+ */
+int
+perf_start(struct TokenRingData *control)
+{
+	struct perf_counters *pc;
+	int i;
+
+	if ((pc = calloc(1, sizeof(*pc))) == NULL) {
+		fprintf(stderr, "Failed to allocate perf counters\n");
+		return -1;
+	}
+	for (i = 0; i < PERF_NUM; i++) {
+		pc->fd[i] = perf_open(perf_events[i].type, perf_events[i].config);
+		if (pc->fd[i] >= 0) {
+			ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &pc->start);
+	control->perf = pc;
+	return 0;
+}
+
+/*
+ * Stop the counters and read them.  Call after the node threads have
+ * been joined so their counts have been folded in.
+ */
+void
+perf_stop(struct TokenRingData *control)
+{
+	struct perf_counters *pc = control->perf;
+	struct timespec end;
+	int i;
+
+	if (!pc)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pc->seconds = (end.tv_sec - pc->start.tv_sec)
+			+ (end.tv_nsec - pc->start.tv_nsec) / 1e9;
+	for (i = 0; i < PERF_NUM; i++) {
+		if (pc->fd[i] < 0)
+			continue;
+		ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(pc->fd[i], &pc->value[i], sizeof(pc->value[i]))
+				!= sizeof(pc->value[i])) {
+			close(pc->fd[i]);
+			pc->fd[i] = -1;
+		}
+	}
+}
+
+/*
+ * Print the counters and release them.
+ */
+void
+perf_report(struct TokenRingData *control)
+{
+	struct perf_counters *pc = control->perf;
+	int i;
+
+	if (!pc)
+		return;
+
+	printf("perf: layout=%s elapsed=%.3fs\n",
+#ifdef PACKED_LAYOUT
+			"packed",
+#else
+			"cache-aligned",
+#endif
+			pc->seconds);
+	for (i = 0; i < PERF_NUM; i++) {
+		if (pc->fd[i] < 0) {
+			printf("perf: %-22s n/a\n", perf_events[i].name);
+		} else {
+			printf("perf: %-22s %llu\n", perf_events[i].name,
+					(unsigned long long) pc->value[i]);
+		}
+	}
+	if (pc->fd[PERF_CACHE_REFS] >= 0 && pc->fd[PERF_CACHE_MISSES] >= 0
+			&& pc->value[PERF_CACHE_REFS] > 0) {
+		printf("perf: cache-miss-rate          %.2f%%\n",
+				100.0 * pc->value[PERF_CACHE_MISSES]
+				/ pc->value[PERF_CACHE_REFS]);
+	}
+
+	for (i = 0; i < PERF_NUM; i++) {
+		if (pc->fd[i] >= 0)
+			close(pc->fd[i]);
+	}
+	free(pc);
+	control->perf = NULL;
+}
@@ -0,0 +1,164 @@
+/*
+ * Fixed-size object pools.
+ *
+ * All the objects are allocated in one go when the pool is set up and
+ * handed out from a lock-free free list (a Treiber stack), so nothing
+ * on the per-packet path goes near the heap.  The list head packs a
+ * tag, bumped on every change, with the index of the top object plus
+ * one, so a thread that was preempted between reading the head and
+ * swapping it cannot put back an object that has been taken and
+ * returned in the meantime (ABA).
+ *
+ * Objects start on cache lines of their own, since the thread that
+ * fills one and the thread that reads it are usually not the same.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "tokenRing.h"
+
+#define	POOL_NONE	0u		/* index + 1 of no object	*/
+
+static unsigned long long
+pool_top(unsigned long long tag, unsigned idx)
+{
+	return (tag << 32) | idx;
+}
+
+int
+pool_init(struct pool *pool, unsigned n_objs, size_t obj_size, int strategy)
+{
+	unsigned i;
+
+	pool->obj_size = (obj_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	pool->n_objs = n_objs;
+	pool->wait_strategy = strategy;
+	pool->objs = alloc_aligned(n_objs, pool->obj_size);
+	pool->next = malloc(n_objs * sizeof(atomic_uint));
+	if (!pool->objs || !pool->next || wait_event_init(&pool->free_ev) < 0) {
+		fprintf(stderr, "Failed to allocate a pool of %u objects\n", n_objs);
+		free(pool->objs);
+		free(pool->next);
+		pool->objs = NULL;
+		pool->next = NULL;
+		return -1;
+	}
+
+	// chain every object onto the free list, lowest first
+	for (i = 0; i < n_objs; i++) {
+		atomic_init(&pool->next[i], i + 1 < n_objs ? i + 2 : POOL_NONE);
+	}
+	atomic_init(&pool->top, pool_top(0, n_objs ? 1 : POOL_NONE));
+	atomic_init(&pool->in_use, 0);
+	atomic_init(&pool->high_water, 0);
+	atomic_init(&pool->exhausted, 0);
+	atomic_init(&pool->starved, 0);
+	return 0;
+}
+
+void
+pool_destroy(struct pool *pool)
+{
+	if (!pool->objs)
+		return;
+	wait_event_destroy(&pool->free_ev);
+	free(pool->objs);
+	free(pool->next);
+	pool->objs = NULL;
+	pool->next = NULL;
+}
+
+/*
+ * Take an object off the free list, or return NULL if there are none
+ * left.
+ */
+static void *
+pool_take(struct pool *pool)
+{
+	unsigned long long top, new;
+	unsigned idx;
+	int used, hw;
+
+	top = atomic_load_explicit(&pool->top, memory_order_acquire);
+	do {
+		if ((idx = (unsigned) top) == POOL_NONE)
+			return NULL;
+		new = pool_top((top >> 32) + 1,
+				atomic_load_explicit(&pool->next[idx - 1], memory_order_relaxed));
+	} while (!atomic_compare_exchange_weak_explicit(&pool->top, &top, new,
+			memory_order_acquire, memory_order_acquire));
+
+	used = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+	hw = atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+	while (used > hw && !atomic_compare_exchange_weak_explicit(&pool->high_water,
+			&hw, used, memory_order_relaxed, memory_order_relaxed))
+		;
+
+	return pool->objs + (size_t) (idx - 1) * pool->obj_size;
+}
+
+/*
+ * Take an object, or return NULL and count the pool as exhausted.
+ */
+void *
+pool_get(struct pool *pool)
+{
+	void *obj;
+
+	if ((obj = pool_take(pool)) == NULL) {
+		atomic_fetch_add_explicit(&pool->exhausted, 1, memory_order_relaxed);
+	}
+	return obj;
+}
+
+/*
+ * Take an object, waiting for one to be put back if the pool is
+ * empty.  Counts as one exhaustion however long it waits.
+ *
+ * starved tells pool_put() someone may be waiting.  Raising it before
+ * looking at the list, as pool_put() swaps the list before looking at
+ * starved, means one of the two always sees the other.
+ */
+void *
+pool_get_wait(struct pool *pool)
+{
+	void *obj;
+	unsigned key;
+
+	if ((obj = pool_get(pool)) != NULL)
+		return obj;
+
+	atomic_fetch_add(&pool->starved, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	for (;;) {
+		key = wait_event_prepare(&pool->free_ev);
+		if ((obj = pool_take(pool)) != NULL)
+			break;
+		wait_event_wait(&pool->free_ev, key, pool->wait_strategy);
+	}
+	atomic_fetch_sub(&pool->starved, 1);
+	return obj;
+}
+
+/*
+ * Put an object back on the free list.
+ */
+void
+pool_put(struct pool *pool, void *obj)
+{
+	unsigned long long top, new;
+	unsigned idx = (unsigned) (((unsigned char *) obj - pool->objs)
+			/ pool->obj_size) + 1;
+
+	atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+	top = atomic_load_explicit(&pool->top, memory_order_relaxed);
+	do {
+		atomic_store_explicit(&pool->next[idx - 1], (unsigned) top,
+				memory_order_relaxed);
+		new = pool_top((top >> 32) + 1, idx);
+	} while (!atomic_compare_exchange_weak_explicit(&pool->top, &top, new,
+			memory_order_seq_cst, memory_order_relaxed));
+
+	if (atomic_load(&pool->starved)) {
+		wait_event_signal(&pool->free_ev, pool->wait_strategy);
+	}
+}
@@ -0,0 +1,348 @@
+/*
+ * Token rotation times (tokensim -R, -o).
+ *
+ * Each time the free token reaches a node, the node takes the time
+ * since it last did as a rotation and records it in a histogram of its
+ * own.  It also keeps a running count, total and peak as atomics,
+ * which a sampler reads every cfg.rot_interval to build a time series
+ * for the whole ring.  The sampler is a thread of its own on a live
+ * ring, and is driven by the event loop in the discrete-event engine,
+ * so a series of a given seed there always comes out the same.
+ *
+ * At cleanup the histograms are merged for the summary, and with -o
+ * the summary and the series are written out as JSON.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "tokenRing.h"
+
+struct rot_sample {
+	unsigned long long t;		/* end of the interval, from start */
+	unsigned long long count;	/* rotations ending in it	*/
+	unsigned long long total;	/* and their time		*/
+	unsigned long long max;
+};
+
+struct rotation {
+	struct hist	*hists;		/* one per node			*/
+	unsigned long long start;	/* ring_now() at the start	*/
+	unsigned long long next;	/* when the next sample is due	*/
+	unsigned long long count;	/* ring totals at the last one	*/
+	unsigned long long total;
+	struct rot_sample *samples;
+	int		n_samples;
+	int		max_samples;
+	int		sampling;	/* the sampler thread is running */
+	int		stop;		/* under lock			*/
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+};
+
+/*
+ * The free token has reached node num.  Only called with -R or -o.
+ */
+void
+rotation_token(struct TokenRingData *control, int num)
+{
+	struct node_data *node = &control->shared_ptr->node[num];
+	unsigned long long now = ring_now(control), rot, peak;
+
+	if (node->token_at) {
+		rot = now - node->token_at;
+		hist_record(node->rotation, rot);
+		// only this node writes these, so there is no need to add
+		// atomically
+		atomic_store_explicit(&node->rot_count, atomic_load_explicit(
+				&node->rot_count, memory_order_relaxed) + 1,
+				memory_order_relaxed);
+		atomic_store_explicit(&node->rot_total, atomic_load_explicit(
+				&node->rot_total, memory_order_relaxed) + rot,
+				memory_order_relaxed);
+		// but the sampler resets the peak
+		peak = atomic_load_explicit(&node->rot_peak, memory_order_relaxed);
+		while (rot > peak && !atomic_compare_exchange_weak_explicit(
+				&node->rot_peak, &peak, rot, memory_order_relaxed,
+				memory_order_relaxed))
+			;
+	}
+	node->token_at = now;
+}
+
+/*
+ * Add a sample of the whole ring up to now.
+ */
+static void
+rotation_sample(struct TokenRingData *control, unsigned long long now)
+{
+	struct rotation *rt = control->rotation;
+	struct node_data *node;
+	struct rot_sample *s;
+	unsigned long long count = 0, total = 0, max = 0, peak;
+	int i;
+
+	if (rt->n_samples == rt->max_samples) {
+		s = realloc(rt->samples, (rt->max_samples ? 2 * rt->max_samples
+				: 64) * sizeof(struct rot_sample));
+		if (!s)
+			panic("Failed to allocate rotation samples\n");
+		rt->samples = s;
+		rt->max_samples = rt->max_samples ? 2 * rt->max_samples : 64;
+	}
+
+	for (i = 0; i < control->cfg.n_nodes; i++) {
+		node = &control->shared_ptr->node[i];
+		count += atomic_load_explicit(&node->rot_count, memory_order_relaxed);
+		total += atomic_load_explicit(&node->rot_total, memory_order_relaxed);
+		peak = atomic_exchange_explicit(&node->rot_peak, 0, memory_order_relaxed);
+		if (peak > max)
+			max = peak;
+	}
+
+	s = &rt->samples[rt->n_samples++];
+	s->t = now - rt->start;
+	s->count = count - rt->count;
+	s->total = total - rt->total;
+	s->max = max;
+	rt->count = count;
+	rt->total = total;
+}
+
+/*
+ * Discrete-event engine: take the samples that fall due by now.
+ */
+void
+rotation_tick(struct TokenRingData *control, unsigned long long now)
+{
+	struct rotation *rt = control->rotation;
+
+	while (now >= rt->next) {
+		rotation_sample(control, rt->next);
+		rt->next += control->cfg.rot_interval;
+	}
+}
+
+static void *
+rotation_sampler(void *arg)
+{
+	struct TokenRingData *control = arg;
+	struct rotation *rt = control->rotation;
+	struct timespec at;
+
+	pthread_mutex_lock(&rt->lock);
+	while (!rt->stop) {
+		at.tv_sec = rt->next / 1000000000ULL;
+		at.tv_nsec = rt->next % 1000000000ULL;
+		if (pthread_cond_timedwait(&rt->wake, &rt->lock, &at) == ETIMEDOUT) {
+			rotation_sample(control, rt->next);
+			rt->next += control->cfg.rot_interval;
+		}
+	}
+	pthread_mutex_unlock(&rt->lock);
+	return NULL;
+}
+
+/*
+ * Set up before the nodes start, and on a live ring start the sampler.
+ */
+int
+rotation_start(struct TokenRingData *control)
+{
+	struct rotation *rt;
+	pthread_condattr_t attr;
+	int i;
+
+	if ((rt = calloc(1, sizeof(struct rotation))) == NULL
+			|| (rt->hists = alloc_aligned(control->cfg.n_nodes,
+				sizeof(struct hist))) == NULL) {
+		fprintf(stderr, "Failed to allocate rotation histograms\n");
+		free(rt);
+		return -1;
+	}
+	control->rotation = rt;
+	for (i = 0; i < control->cfg.n_nodes; i++) {
+		control->shared_ptr->node[i].rotation = &rt->hists[i];
+	}
+	rt->start = ring_now(control);
+	rt->next = rt->start + control->cfg.rot_interval;
+
+	if (control->cfg.des)
+		return 0;
+
+	if (pthread_mutex_init(&rt->lock, NULL) != 0
+			|| pthread_condattr_init(&attr) != 0
+			|| pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0
+			|| pthread_cond_init(&rt->wake, &attr) != 0) {
+		panic("Failed to set up the rotation sampler\n");
+	}
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&rt->thread, NULL, rotation_sampler, control) != 0) {
+		panic("Thread creation failed for the rotation sampler\n");
+	}
+	rt->sampling = 1;
+	return 0;
+}
+
+/*
+ * Once the nodes have stopped: stop the sampler and take a last sample
+ * of what is left of the interval.
+ */
+void
+rotation_stop(struct TokenRingData *control)
+{
+	struct rotation *rt = control->rotation;
+	unsigned long long now;
+
+	if (!rt)
+		return;
+	if (rt->sampling) {
+		pthread_mutex_lock(&rt->lock);
+		rt->stop = 1;
+		pthread_cond_signal(&rt->wake);
+		pthread_mutex_unlock(&rt->lock);
+		pthread_join(rt->thread, NULL);
+		pthread_cond_destroy(&rt->wake);
+		pthread_mutex_destroy(&rt->lock);
+		rt->sampling = 0;
+	} else {
+		rotation_tick(control, ring_now(control));
+	}
+	now = ring_now(control);
+	if (now > rt->next - control->cfg.rot_interval) {
+		rotation_sample(control, now);
+	}
+}
+
+static void
+rotation_line(const char *who, const struct hist *h, double scale)
+{
+	printf("  %-8s %8llu  %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			who, h->count, h->min / scale,
+			h->count ? h->sum / scale / h->count : 0.0,
+			hist_percentile(h, 50.0) / scale, hist_percentile(h, 90.0) / scale,
+			hist_percentile(h, 99.0) / scale, hist_percentile(h, 99.9) / scale,
+			h->max / scale);
+}
+
+static void
+rotation_json_stats(FILE *f, const struct hist *h)
+{
+	fprintf(f, "\"rotations\": %llu, \"min\": %llu, \"mean\": %.1f, "
+			"\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, "
+			"\"max\": %llu", h->count, h->min,
+			h->count ? (double) h->sum / h->count : 0.0,
+			hist_percentile(h, 50.0), hist_percentile(h, 90.0),
+			hist_percentile(h, 99.0), hist_percentile(h, 99.9), h->max);
+}
+
+/*
+ * Write the rotation times to cfg.rot_file, with the ring number after
+ * the name on a campus.  Times are in ring_now() units.
+ */
+static void
+rotation_write(struct TokenRingData *control, const struct hist *ring)
+{
+	struct rotation *rt = control->rotation;
+	struct rot_sample *s;
+	char name[4096];
+	FILE *f;
+	int i;
+
+	if (control->cfg.n_rings > 1) {
+		snprintf(name, sizeof(name), "%s.%d", control->cfg.rot_file,
+				control->cfg.ring);
+	} else {
+		snprintf(name, sizeof(name), "%s", control->cfg.rot_file);
+	}
+	if ((f = fopen(name, "w")) == NULL) {
+		fprintf(stderr, "Cannot write rotation times to %s: %s\n", name,
+				strerror(errno));
+		return;
+	}
+
+	fprintf(f, "{\n  \"units\": \"%s\",\n  \"nodes\": %d,\n  \"interval\": %llu,\n",
+			control->cfg.des ? "ticks" : "ns", control->cfg.n_nodes,
+			control->cfg.rot_interval);
+	fprintf(f, "  \"ring\": { ");
+	rotation_json_stats(f, ring);
+	fprintf(f, " },\n  \"node\": [\n");
+	for (i = 0; i < control->cfg.n_nodes; i++) {
+		fprintf(f, "    { \"node\": %d, ", i);
+		rotation_json_stats(f, &rt->hists[i]);
+		fprintf(f, " }%s\n", i + 1 < control->cfg.n_nodes ? "," : "");
+	}
+	fprintf(f, "  ],\n  \"series\": [\n");
+	for (i = 0; i < rt->n_samples; i++) {
+		s = &rt->samples[i];
+		fprintf(f, "    { \"t\": %llu, \"rotations\": %llu, \"mean\": %.1f, "
+				"\"max\": %llu }%s\n", s->t, s->count,
+				s->count ? (double) s->total / s->count : 0.0, s->max,
+				i + 1 < rt->n_samples ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Cannot write rotation times to %s: %s\n", name,
+				strerror(errno));
+	}
+}
+
+/*
+ * The rotation times of the whole ring and of each node, and the series,
+ * in us on a live ring and ticks in the discrete-event engine.
+ */
+void
+rotation_report(struct TokenRingData *control)
+{
+	struct rotation *rt = control->rotation;
+	struct rot_sample *s;
+	struct hist ring;
+	double scale = control->cfg.des ? 1.0 : 1e3;
+	const char *units = control->cfg.des ? "ticks" : "us";
+	char who[16];
+	int i;
+
+	if (!rt)
+		return;
+
+	memset(&ring, 0, sizeof(ring));
+	for (i = 0; i < control->cfg.n_nodes; i++) {
+		hist_merge(&ring, &rt->hists[i]);
+	}
+
+	if (control->cfg.n_rings > 1) {
+		printf("ring %d ", control->cfg.ring);
+	}
+	printf("rotation (%s):\n  %-8s %8s  %10s %10s %10s %10s %10s %10s %10s\n",
+			units, "node", "tokens", "min", "mean", "p50", "p90", "p99",
+			"p99.9", "max");
+	rotation_line("ring", &ring, scale);
+	for (i = 0; i < control->cfg.n_nodes; i++) {
+		snprintf(who, sizeof(who), "%d", i);
+		rotation_line(who, &rt->hists[i], scale);
+	}
+
+	if (control->cfg.n_rings > 1) {
+		printf("ring %d ", control->cfg.ring);
+	}
+	printf("rotation series, every %.1f %s:\n  %10s %8s  %10s %10s\n",
+			control->cfg.rot_interval / scale, units, "t", "tokens",
+			"mean", "max");
+	for (i = 0; i < rt->n_samples; i++) {
+		s = &rt->samples[i];
+		printf("  %10.1f %8llu  %10.1f %10.1f\n", s->t / scale, s->count,
+				s->count ? s->total / scale / s->count : 0.0, s->max / scale);
+	}
+
+	if (control->cfg.rot_file) {
+		rotation_write(control, &ring);
+	}
+
+	free(rt->samples);
+	free(rt->hists);
+	free(rt);
+	control->rotation = NULL;
+}
@@ -0,0 +1,463 @@
+/*
+ * M:N execution: the nodes of the ring run as tasks on a small pool of
+ * worker threads instead of a thread each (tokensim -m).
+ *
+ * A node's receive and send state machines live in node_data, so a
+ * task is nothing more than a node number.  Running it takes elements
+ * off the node's inbound link and hands them to token_node_byte() or
+ * token_node_frame(), for as long as there is data coming in and room
+ * going out.  A task is made runnable by whoever changes that: the
+ * upstream node publishing on the task's inbound link, or the
+ * downstream node freeing a slot on its outbound link after the task
+ * has said it is waiting for one.
+ *
+ * Each worker has a Chase-Lev work-stealing deque.  Tasks woken while a
+ * worker runs go on that worker's own deque and it takes them back
+ * LIFO, so the token tends to stay on one worker (and in its cache) as
+ * it goes round; workers with nothing to do steal from the other end,
+ * and park on a wait_event with the configured wait strategy when there
+ * is nothing to steal either.
+ *
+ * Only the node tasks and the pool's own threads touch the links, so
+ * the links are always LINK_SPSC and nobody blocks in them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "tokenRing.h"
+
+/* task states */
+#define	TASK_IDLE	0	/* waiting on its links			*/
+#define	TASK_QUEUED	1	/* on a worker's deque			*/
+#define	TASK_RUNNING	2	/* being run				*/
+#define	TASK_NOTIFIED	3	/* being run, and woken again meanwhile	*/
+
+#define	TASK_NONE	(-1)
+
+/* elements a task handles before it goes back on the deque */
+#define	TASK_BUDGET	64
+
+struct node_task {
+	CACHE_ALIGNED atomic_int state;
+	atomic_int	want_space;	/* stopped on a full outbound link */
+};
+
+/*
+ * Deque of task numbers.  Only the owning worker pushes and takes, at
+ * the bottom; anyone may steal from the top.  A task is on at most one
+ * deque at a time, so a deque never holds more than n_nodes entries and
+ * never has to grow.
+ */
+struct ws_deque {
+	CACHE_ALIGNED atomic_long top;
+	CACHE_ALIGNED atomic_long bottom;
+	long		mask;
+	atomic_int	*buf;
+};
+
+struct sched_worker {
+	struct ws_deque	dq;
+	struct sched_pool *pool;
+	pthread_t	thread;
+	int		id;
+	unsigned long	ran;		/* tasks run		*/
+	unsigned long	stolen;		/* of those, stolen	*/
+};
+
+struct sched_pool {
+	struct TokenRingData *control;
+	struct node_task *tasks;	/* cfg.n_nodes entries	*/
+	struct sched_worker *workers;	/* cfg.workers entries	*/
+	int		started;
+	CACHE_ALIGNED atomic_int idle;	/* workers going to park	*/
+	struct wait_event idle_ev;
+};
+
+/* the worker running on this thread, NULL outside the pool */
+static _Thread_local struct sched_worker *self;
+
+static int
+dq_init(struct ws_deque *dq, int capacity)
+{
+	long size = 1;
+
+	while (size < capacity)
+		size <<= 1;
+
+	if ((dq->buf = malloc(size * sizeof(atomic_int))) == NULL) {
+		fprintf(stderr, "Failed to allocate run queue\n");
+		return -1;
+	}
+	dq->mask = size - 1;
+	atomic_init(&dq->top, 0);
+	atomic_init(&dq->bottom, 0);
+	return 0;
+}
+
+static long
+dq_size(struct ws_deque *dq)
+{
+	return atomic_load_explicit(&dq->bottom, memory_order_relaxed)
+		- atomic_load_explicit(&dq->top, memory_order_relaxed);
+}
+
+static void
+dq_push(struct ws_deque *dq, int task)
+{
+	long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+
+	atomic_store_explicit(&dq->buf[b & dq->mask], task, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+}
+
+static int
+dq_take(struct ws_deque *dq)
+{
+	long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+	long t;
+	int task = TASK_NONE;
+
+	atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+	if (t <= b) {
+		task = atomic_load_explicit(&dq->buf[b & dq->mask], memory_order_relaxed);
+		if (t == b) {
+			// the last one: a thief may be after it too
+			if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+					memory_order_seq_cst, memory_order_relaxed))
+				task = TASK_NONE;
+			atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+	}
+	return task;
+}
+
+static int
+dq_steal(struct ws_deque *dq)
+{
+	long t = atomic_load_explicit(&dq->top, memory_order_acquire);
+	long b;
+	int task;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+	if (t >= b)
+		return TASK_NONE;
+
+	task = atomic_load_explicit(&dq->buf[t & dq->mask], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+			memory_order_seq_cst, memory_order_relaxed))
+		return TASK_NONE;
+	return task;
+}
+
+/*
+ * Try every other worker's deque once, starting with the next one.
+ */
+static int
+sched_steal(struct sched_pool *pool, struct sched_worker *w)
+{
+	int n_workers = pool->control->cfg.workers;
+	int i, task;
+
+	for (i = 1; i < n_workers; i++) {
+		task = dq_steal(&pool->workers[(w->id + i) % n_workers].dq);
+		if (task != TASK_NONE) {
+			w->stolen++;
+			return task;
+		}
+	}
+	return TASK_NONE;
+}
+
+/*
+ * Put a task on the current worker's deque.  The worker gets to it
+ * itself as soon as it is done with the task in hand, so a parked
+ * worker is only woken to steal when more than that is queued.
+ */
+static void
+sched_push(struct sched_pool *pool, int num)
+{
+	struct sched_worker *w = self;
+
+	if (!w) {
+		// only node #0's first token is sent from outside the pool
+		if (pool->started)
+			panic("Node %d woken from outside the worker pool\n", num);
+		w = &pool->workers[0];
+	}
+	dq_push(&w->dq, num);
+
+	if (pool->started && dq_size(&w->dq) > 1) {
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&pool->idle, memory_order_relaxed) > 0)
+			wait_event_signal(&pool->idle_ev,
+					pool->control->cfg.wait_strategy);
+	}
+}
+
+/*
+ * Make node num's task runnable: queue it if it is idle, or tell it to
+ * go round again if it is running right now.  This is always done with
+ * a compare-and-swap, even when there is nothing to change, so that the
+ * worker that runs the task next is ordered after our link update.
+ */
+void
+sched_wake(struct TokenRingData *control, int num)
+{
+	struct node_task *task = &control->sched->tasks[num];
+	int state = TASK_IDLE, next;
+
+	do {
+		if (state == TASK_IDLE)
+			next = TASK_QUEUED;
+		else if (state == TASK_RUNNING)
+			next = TASK_NOTIFIED;
+		else
+			next = state;
+	} while (!atomic_compare_exchange_weak(&task->state, &state, next));
+
+	if (state == TASK_IDLE)
+		sched_push(control->sched, num);
+}
+
+/*
+ * The node reading link num has freed a slot on it.  Wake the node
+ * writing the link if it stopped because the link was full.
+ */
+void
+sched_link_released(struct TokenRingData *control, int num)
+{
+	int prev = (num + control->cfg.n_nodes - 1) % control->cfg.n_nodes;
+	struct node_task *task = &control->sched->tasks[prev];
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&task->want_space, memory_order_relaxed)
+			&& atomic_exchange(&task->want_space, 0))
+		sched_wake(control, prev);
+}
+
+/*
+ * Run node num until its inbound link is empty, its outbound link is
+ * full or it has used up its budget.  Returns 1 if it should be run
+ * again straight away.
+ */
+static int
+task_run(struct TokenRingData *control, int num)
+{
+	struct node_task *task = &control->sched->tasks[num];
+	struct spsc_link *in = &control->links[num];
+	struct spsc_link *out = &control->links[(num + 1) % control->cfg.n_nodes];
+	struct data_pkt pkt;
+	// with early token release a frame may go out followed by a token
+	unsigned room = control->cfg.etr ? 2 : 1;
+	int done;
+
+	for (done = 0; done < TASK_BUDGET; done++) {
+		if (node_terminating(control, num) || spsc_try_read_slot(in) == NULL)
+			return 0;
+		if (!spsc_has_room(out, room)) {
+			// ask to be woken when there is room, then look again
+			atomic_store_explicit(&task->want_space, 1, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+			if (!spsc_has_room(out, room))
+				return 0;
+			atomic_store_explicit(&task->want_space, 0, memory_order_relaxed);
+		}
+
+		if (control->cfg.xfer_mode == XFER_FRAME) {
+			if (!rcv_frame(control, num, &pkt))
+				return 0;
+			token_node_frame(control, num, &pkt);
+		} else if (!token_node_byte(control, num, rcv_byte(control, num))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+task_execute(struct sched_worker *w, int num)
+{
+	struct node_task *task = &w->pool->tasks[num];
+	int state = TASK_RUNNING;
+
+	atomic_exchange(&task->state, TASK_RUNNING);
+	w->ran++;
+
+	if (!task_run(w->pool->control, num)
+			&& atomic_compare_exchange_strong(&task->state, &state, TASK_IDLE))
+		return;
+
+	// out of budget, or woken while running
+	atomic_store(&task->state, TASK_QUEUED);
+	sched_push(w->pool, num);
+}
+
+static void *
+sched_worker(void *arg)
+{
+	struct sched_worker *w = arg;
+	struct sched_pool *pool = w->pool;
+	struct TokenRingData *control = pool->control;
+	unsigned key;
+	int num;
+
+	self = w;
+	for (;;) {
+		if ((num = dq_take(&w->dq)) == TASK_NONE)
+			num = sched_steal(pool, w);
+
+		if (num == TASK_NONE) {
+			if (atomic_load_explicit(&control->shared_ptr->cleanup_in_progress,
+					memory_order_acquire))
+				break;
+
+			atomic_fetch_add(&pool->idle, 1);
+			key = wait_event_prepare(&pool->idle_ev);
+			num = sched_steal(pool, w);
+			if (num == TASK_NONE && !atomic_load(&control->shared_ptr->cleanup_in_progress))
+				wait_event_wait(&pool->idle_ev, key, control->cfg.wait_strategy);
+			atomic_fetch_sub(&pool->idle, 1);
+			if (num == TASK_NONE)
+				continue;
+		}
+		task_execute(w, num);
+	}
+#ifdef DEBUG
+	fprintf(stderr, "Worker %d: Clean exit\n", w->id);
+#endif
+	return NULL;
+}
+
+/*
+ * Allocate the tasks and the workers' run queues.
+ */
+int
+sched_init(struct TokenRingData *control)
+{
+	struct sched_pool *pool;
+	int i, n_workers = control->cfg.workers;
+
+	if (control->cfg.link_type != LINK_SPSC) {
+		fprintf(stderr, "The worker pool needs spsc links\n");
+		return -1;
+	}
+
+	pool = alloc_aligned(1, sizeof(struct sched_pool));
+	if (!pool) {
+		fprintf(stderr, "Failed to allocate worker pool\n");
+		return -1;
+	}
+	pool->control = control;
+	pool->tasks = alloc_aligned(control->cfg.n_nodes, sizeof(struct node_task));
+	pool->workers = alloc_aligned(n_workers, sizeof(struct sched_worker));
+	if (!pool->tasks || !pool->workers) {
+		fprintf(stderr, "Failed to allocate worker pool\n");
+		goto FAIL;
+	}
+
+	for (i = 0; i < control->cfg.n_nodes; i++) {
+		atomic_init(&pool->tasks[i].state, TASK_IDLE);
+		atomic_init(&pool->tasks[i].want_space, 0);
+	}
+	for (i = 0; i < n_workers; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		if (dq_init(&pool->workers[i].dq, control->cfg.n_nodes) < 0)
+			goto FAIL;
+	}
+	atomic_init(&pool->idle, 0);
+	if (wait_event_init(&pool->idle_ev) < 0)
+		goto FAIL;
+
+	control->sched = pool;
+	return 0;
+
+FAIL:
+	if (pool->workers) {
+		for (i = 0; i < n_workers; i++)
+			free(pool->workers[i].dq.buf);
+	}
+	free(pool->workers);
+	free(pool->tasks);
+	free(pool);
+	return -1;
+}
+
+void
+sched_destroy(struct TokenRingData *control)
+{
+	struct sched_pool *pool = control->sched;
+	int i;
+
+	if (!pool)
+		return;
+
+	wait_event_destroy(&pool->idle_ev);
+	for (i = 0; i < control->cfg.workers; i++)
+		free(pool->workers[i].dq.buf);
+	free(pool->workers);
+	free(pool->tasks);
+	free(pool);
+	control->sched = NULL;
+}
+
+/*
+ * Put the first token and any fill on the ring and start the workers.
+ */
+int
+sched_start(struct TokenRingData *control)
+{
+	struct sched_pool *pool = control->sched;
+	int i;
+
+	for (i = 0; i < control->cfg.n_nodes; i++) {
+		token_node_start(control, i);
+	}
+	pool->started = 1;
+
+	for (i = 0; i < control->cfg.workers; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL,
+				sched_worker, &pool->workers[i]) != 0) {
+			panic("Thread creation failed for worker %d\n", i);
+		}
+#ifdef DEBUG
+		fprintf(stderr, "Created worker thread %d\n", i);
+#endif
+	}
+	return 0;
+}
+
+/*
+ * Wait for the workers to finish.  cleanup_in_progress has been raised,
+ * so once they have run out of tasks they leave instead of parking;
+ * wake each of those already parked.
+ */
+void
+sched_stop(struct TokenRingData *control)
+{
+	struct sched_pool *pool = control->sched;
+	int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < control->cfg.workers; i++)
+		wait_event_signal(&pool->idle_ev, control->cfg.wait_strategy);
+
+	for (i = 0; i < control->cfg.workers; i++) {
+		if (pthread_join(pool->workers[i].thread, NULL) != 0) {
+#ifdef DEBUG
+			fprintf(stderr, "Warning: Worker %d join failed\n", i);
+#endif
+		}
+#ifdef DEBUG
+		fprintf(stderr, "Worker %d: ran %lu tasks, %lu stolen\n", i,
+				pool->workers[i].ran, pool->workers[i].stolen);
+#endif
+	}
+}
@@ -61,176 +61,734 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include "tokenRing.h"
 
+#define	ALPHABET	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+
+/*
+ * The test content of every packet, 'A' + (j % 26) at j, so filling one
+ * in is a memcpy() the C library can do a vector at a time.
+ */
+static const char fill_pattern[] = ALPHABET ALPHABET ALPHABET ALPHABET
+	ALPHABET ALPHABET ALPHABET ALPHABET ALPHABET ALPHABET;
+_Static_assert(sizeof(fill_pattern) >= MAX_DATA, "fill pattern too short");
+
+/*
+ * Zeroed, cache line aligned allocation for the shared arrays; free()
+ * releases it.
+ */
+void *
+alloc_aligned(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (posix_memalign(&ptr, CACHE_LINE, nmemb * size) != 0) {
+		return NULL;
+	}
+	memset(ptr, 0, nmemb * size);
+	return ptr;
+}
+
+/*
+ * Destroy CRIT and the semaphores of the first nodes nodes.  The
+ * padding between them was never initialised.
+ */
+static void
+destroy_sems(struct TokenRingData *control, int nodes)
+{
+	int i;
+
+	sem_destroy(&control->sems[CRIT]);
+	for (i = 0; i < nodes; i++) {
+		sem_destroy(&control->sems[EMPTY(i)]);
+		sem_destroy(&control->sems[FILLED(i)]);
+		sem_destroy(&control->sems[TO_SEND(i)]);
+	}
+}
+
+#ifdef SEM_STATS
+/*
+ * sem_wait() on sems[sem], counting it, and if the semaphore was taken
+ * how long the wait blocked for.
+ */
+int
+sem_wait_counted(struct TokenRingData *control, int sem)
+{
+	struct sem_stats *st = &control->sem_stats[sem];
+	struct timespec start, end;
+	int ret;
+
+	if (sem_trywait(&control->sems[sem]) == 0) {
+		st->acquired++;
+		return 0;
+	}
+	if (errno != EAGAIN) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = sem_wait(&control->sems[sem]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret == 0) {
+		st->acquired++;
+		st->contended++;
+		st->blocked_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL
+			+ end.tv_nsec - start.tv_nsec;
+	}
+	return ret;
+}
+
+/*
+ * sem_trywait() on sems[sem].  Only a wait that gets the semaphore
+ * counts; one that does not is followed by a SEM_WAIT() that will.
+ */
+int
+sem_trywait_counted(struct TokenRingData *control, int sem)
+{
+	int ret = sem_trywait(&control->sems[sem]);
+
+	if (ret == 0) {
+		control->sem_stats[sem].acquired++;
+	}
+	return ret;
+}
+#endif
+
+/*
+ * Free the slots of the semaphore links, and the arrival times of the
+ * virtual clock.
+ */
+static void
+free_link_slots(struct TokenRingData *control)
+{
+	int i;
+
+	for (i = 0; i < control->cfg.n_nodes; i++) {
+		free(control->shared_ptr->link[i].data_xfer);
+		free(control->shared_ptr->link[i].frame_xfer);
+		free(control->shared_ptr->link[i].vt);
+	}
+}
+
 /*
  * The main program creates the shared memory region and forks off the
  * processes to emulate the token ring nodes.
  * This process generates packets at random and inserts them in
- * the to_send field of the nodes. When done it waits for each process
+ * the transmit queues of the nodes. When done it waits for each process
  * to be done receiving and then tells them to terminate and waits
  * for them to die and prints out the sent/received counts.
  */
 struct TokenRingData *
-setupSystem()
+setupSystem(const struct TokenRingConfig *cfg)
 {
 	register int i;
+	int j, nsem = -1;
+	size_t elem_size;
+	int n_nodes = cfg->n_nodes;
 	struct TokenRingData *control;
 
-	control = (struct TokenRingData *) malloc(sizeof(struct TokenRingData));
+	control = (struct TokenRingData *) calloc(1, sizeof(struct TokenRingData));
 	if (!control) {
 		fprintf(stderr, "Failed to allocate control structure\n");
 		return NULL;
 	}
+	control->cfg = *cfg;
+
+	crc32c_init();
+
+	// each ring of a campus draws its own packets
+	if (initstate_r(control->cfg.seed + control->cfg.ring, control->rng_state,
+			sizeof(control->rng_state), &control->rng) < 0) {
+		fprintf(stderr, "Failed to seed the packet generator\n");
+		goto FAIL;
+	}
 
 	// allocate semaphore array
-	control->sems = malloc(NUM_SEM * sizeof(sem_t));
+	control->sems = alloc_aligned(NUM_SEM(n_nodes), sizeof(sem_t));
 	if (!control->sems) {
 		fprintf(stderr, "Failed to allocate semaphore array\n");
-		free(control);
-		return NULL;
+		goto FAIL;
+	}
+#ifdef SEM_STATS
+	control->sem_stats = alloc_aligned(NUM_SEM(n_nodes), sizeof(struct sem_stats));
+	if (!control->sem_stats) {
+		fprintf(stderr, "Failed to allocate semaphore counts\n");
+		goto FAIL;
 	}
+#endif
 
-	// allocate shared data
-	control->shared_ptr = (struct shared_data *)malloc(sizeof(struct shared_data));
+	// allocate shared data and the per link and per node arrays
+	control->shared_ptr = (struct shared_data *)alloc_aligned(1, sizeof(struct shared_data));
 	if (!control->shared_ptr) {
 		fprintf(stderr, "Failed to allocate shared data\n");
-		free(control->sems);
-		free(control);
-		return NULL;
+		goto FAIL;
+	}
+	control->shared_ptr->link = alloc_aligned(n_nodes, sizeof(struct link_data));
+	control->shared_ptr->node = alloc_aligned(n_nodes, sizeof(struct node_data));
+	control->shared_ptr->txq = alloc_aligned((size_t) n_nodes * control->cfg.n_prio
+			* control->cfg.txq_depth, sizeof(struct data_pkt *));
+	if (!control->shared_ptr->link || !control->shared_ptr->node
+			|| !control->shared_ptr->txq) {
+		fprintf(stderr, "Failed to allocate node data\n");
+		goto FAIL;
 	}
 
-	// allocate thread arguments
-	control->thread_args = malloc(N_NODES * sizeof(struct token_args));
-	if (!control->thread_args) {
+	// a histogram of each latency for each node, when asked for
+	if (control->cfg.latency) {
+		control->shared_ptr->lat = alloc_aligned((size_t) n_nodes * N_LAT,
+				sizeof(struct hist));
+		if (!control->shared_ptr->lat) {
+			fprintf(stderr, "Failed to allocate latency histograms\n");
+			goto FAIL;
+		}
+		for (i = 0; i < n_nodes; i++) {
+			control->shared_ptr->node[i].lat = control->shared_ptr->lat + i * N_LAT;
+		}
+	}
+
+	/*
+	 * The frames the transmit queues point at.  By default there are
+	 * enough to fill every queue, so only a smaller pool set with -b
+	 * ever runs dry.
+	 */
+	control->frames = alloc_aligned(1, sizeof(struct pool));
+	if (!control->frames || pool_init(control->frames, control->cfg.pool_frames ?
+			control->cfg.pool_frames : n_nodes * control->cfg.txq_depth, sizeof(struct data_pkt), control->cfg.wait_strategy) < 0) {
+		free(control->frames);
+		control->frames = NULL;
+		goto FAIL;
+	}
+
+	/*
+	 * Multicast groups.  Everyone is in the broadcast group; each node
+	 * joins each of the others at random.
+	 */
+	if (control->cfg.n_groups > 0) {
+		control->group_words = (n_nodes + 63) / 64;
+		control->groups = calloc((size_t) control->cfg.n_groups
+				* control->group_words, sizeof(uint64_t));
+		if (!control->groups) {
+			fprintf(stderr, "Failed to allocate multicast groups\n");
+			goto FAIL;
+		}
+		for (j = 0; j < control->cfg.n_groups; j++) {
+			for (i = 0; i < n_nodes; i++) {
+				if (j == BROADCAST_GROUP || ring_random(control) & 1) {
+					control->groups[j * control->group_words + i / 64]
+						|= (uint64_t) 1 << (i % 64);
+				}
+			}
+		}
+	}
+
+	// allocate thread ids, node numbers and thread arguments
+	control->threads = calloc(n_nodes, sizeof(pthread_t));
+	control->node_numbers = calloc(n_nodes, sizeof(int));
+	control->thread_args = malloc(n_nodes * sizeof(struct token_args));
+	if (!control->threads || !control->node_numbers || !control->thread_args) {
 		fprintf(stderr, "Failed to allocate thread arguments\n");
 		goto FAIL;
 	}
 
 	// initialize semaphores
-	for (i = 0; i < NUM_SEM; i++) {
-		if (sem_init(&control->sems[i], 0, (i < N_NODES || i >= FILLED0 + N_NODES) ? 1 : 0) < 0) {
-			fprintf(stderr, "Failed to initialize semaphore %d\n", i);
+	if (sem_init(&control->sems[CRIT], 0, 1) < 0) {
+		fprintf(stderr, "Failed to initialize semaphore %d\n", CRIT);
+		goto FAIL;
+	}
+	for (nsem = 0; nsem < n_nodes; nsem++) {
+		if (sem_init(&control->sems[EMPTY(nsem)], 0,
+					control->cfg.link_depth) < 0
+				|| sem_init(&control->sems[FILLED(nsem)], 0, 0) < 0
+				|| sem_init(&control->sems[TO_SEND(nsem)], 0,
+					control->cfg.txq_depth) < 0) {
+			fprintf(stderr, "Failed to initialize semaphores of node %d\n", nsem);
+			goto FAIL;
+		}
+	}
+
+	// allocate the lock-free link buffers, one inbound link per node
+	if (control->cfg.link_type == LINK_SPSC) {
+		control->links = alloc_aligned(n_nodes, sizeof(struct spsc_link));
+		if (!control->links) {
+			fprintf(stderr, "Failed to allocate links\n");
 			goto FAIL;
 		}
+		// zero-copy frames leave their payload behind
+		elem_size = 1;
+		if (control->cfg.xfer_mode == XFER_FRAME) {
+			elem_size = control->cfg.zero_copy ? FRAME_HEADER
+				: sizeof(struct data_pkt);
+		}
+		for (j = 0; j < n_nodes; j++) {
+			if (spsc_link_init(&control->links[j], control->cfg.link_depth,
+					elem_size) < 0) {
+				goto FAIL;
+			}
+		}
+	} else {
+		// or the slots of the semaphore links, as on the blackboard
+		for (j = 0; j < n_nodes; j++) {
+			if (control->cfg.xfer_mode == XFER_FRAME) {
+				control->shared_ptr->link[j].frame_xfer = alloc_aligned(
+						control->cfg.link_depth, sizeof(struct data_pkt));
+			} else {
+				control->shared_ptr->link[j].data_xfer = alloc_aligned(
+						control->cfg.link_depth, 1);
+			}
+			if (!control->shared_ptr->link[j].data_xfer
+					&& !control->shared_ptr->link[j].frame_xfer) {
+				fprintf(stderr, "Failed to allocate links\n");
+				goto FAIL;
+			}
+		}
+	}
+
+	/*
+	 * The virtual clock's arrival times, a ring per link as deep as
+	 * either kind of link can get.
+	 */
+	if (control->cfg.byte_ps) {
+		for (control->vt_mask = 1; control->vt_mask < control->cfg.link_depth; )
+			control->vt_mask <<= 1;
+		for (j = 0; j < n_nodes; j++) {
+			control->shared_ptr->link[j].vt = alloc_aligned(control->vt_mask,
+					sizeof(unsigned long long));
+			if (!control->shared_ptr->link[j].vt) {
+				fprintf(stderr, "Failed to allocate link clocks\n");
+				goto FAIL;
+			}
+		}
+		control->vt_mask--;
 	}
 
 	// initialize node 
-	for (i = 0; i < N_NODES; i++) {
+	atomic_init(&control->shared_ptr->cleanup_in_progress, 0);
+	for (i = 0; i < n_nodes; i++) {
 		control->shared_ptr->node[i].sent = 0;
 		control->shared_ptr->node[i].received = 0;
-		control->shared_ptr->node[i].terminate = 0;
-		control->shared_ptr->node[i].to_send.length = 0;
-		control->shared_ptr->node[i].data_xfer = 0;
-		control->shared_ptr->node[i].to_send.token_flag = '1';
+		atomic_init(&control->shared_ptr->node[i].terminate, 0);
+		atomic_init(&control->shared_ptr->node[i].pending, 0);
+		control->shared_ptr->node[i].txq = control->shared_ptr->txq
+			+ (size_t) i * control->cfg.n_prio * control->cfg.txq_depth;
+		for (j = 0; j < MAX_PRIO; j++) {
+			control->shared_ptr->node[i].tx_head[j] = 0;
+			atomic_init(&control->shared_ptr->node[i].tx_tail[j], 0);
+		}
+		control->shared_ptr->node[i].state.rcv_state = TOKEN_FLAG;
+		control->shared_ptr->node[i].state.snd_state = TOKEN_FLAG;
+		control->shared_ptr->link[i].next_empty = 0;
+		control->shared_ptr->link[i].next_full = 0;
 		control->node_numbers[i] = i; 
 	}
 
+	// the queue of frames coming in from other rings
+	if (control->cfg.n_rings > 1) {
+		control->bridge = alloc_aligned(1, sizeof(struct bridge_queue));
+		if (!control->bridge) {
+			fprintf(stderr, "Failed to allocate bridge queue\n");
+			goto FAIL;
+		}
+		control->bridge->pkts = malloc(BRIDGE_QUEUE_DEPTH * sizeof(struct data_pkt));
+		if (!control->bridge->pkts
+				|| pthread_mutex_init(&control->bridge->lock, NULL) != 0) {
+			fprintf(stderr, "Failed to initialize bridge queue\n");
+			free(control->bridge->pkts);
+			free(control->bridge);
+			control->bridge = NULL;
+			goto FAIL;
+		}
+		atomic_init(&control->bridge->queued, 0);
+		atomic_init(&control->bridge->backlog, 0);
+	}
+
 	// initialize thread 
-	for (i = 0; i < N_NODES; i++) {
+	for (i = 0; i < n_nodes; i++) {
 		control->thread_args[i].control = control;
 		control->thread_args[i].node_num = i;
 	}
 
-	srandom(time(0));
+	// or the worker pool that runs the nodes as tasks
+	if (control->cfg.workers > 0 && sched_init(control) < 0) {
+		goto FAIL;
+	}
+
 	return control;
 
 FAIL:
-	if (control) {
-		if (control->thread_args) free(control->thread_args);
-		if (control->sems) {
-			// destroy initialized semaphores
-			for (int j = 0; j < i; j++) {
-				sem_destroy(&control->sems[j]);
-			}
-			free(control->sems);
+	free(control->groups);
+	if (control->frames) {
+		pool_destroy(control->frames);
+		free(control->frames);
+	}
+	if (control->bridge) {
+		pthread_mutex_destroy(&control->bridge->lock);
+		free(control->bridge->pkts);
+		free(control->bridge);
+	}
+	if (control->links) {
+		for (j = 0; j < n_nodes; j++) {
+			spsc_link_destroy(&control->links[j]);
+		}
+		free(control->links);
+	}
+	if (control->sems) {
+		// destroy initialized semaphores
+		if (nsem >= 0) {
+			destroy_sems(control, nsem);
+		}
+		free(control->sems);
+	}
+#ifdef SEM_STATS
+	free(control->sem_stats);
+#endif
+	if (control->shared_ptr) {
+		if (control->shared_ptr->link) {
+			free_link_slots(control);
 		}
-		if (control->shared_ptr) free(control->shared_ptr);
-		free(control);
+		free(control->shared_ptr->link);
+		free(control->shared_ptr->node);
+		free(control->shared_ptr->txq);
+		free(control->shared_ptr->lat);
+		free(control->shared_ptr);
 	}
+	free(control->thread_args);
+	free(control->node_numbers);
+	free(control->threads);
+	free(control);
 	return NULL;
 }
 
+/*
+ * A random() stream of our own, so that the rings of a campus and the
+ * generator threads of a ring do not share (and lock) one.
+ */
+long
+gen_random(rng)
+	struct random_data *rng;
+{
+	int32_t r;
+
+	random_r(rng, &r);
+	return r;
+}
+
+long
+ring_random(control)
+	struct TokenRingData *control;
+{
+	return gen_random(&control->rng);
+}
+
+/*
+ * The time on the ring's clock: discrete-event ticks under -e,
+ * nanoseconds otherwise.
+ */
+unsigned long long
+ring_now(control)
+	struct TokenRingData *control;
+{
+	struct timespec now;
+
+	if (control->cfg.des)
+		return control->des_now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Fill in a frame from the pool with a packet from node num to a random
+ * other node, which on a campus may be on any ring, or cfg.mcast_pct
+ * percent of the time to a random multicast group.  With one generator
+ * both engines draw from the ring's stream in the same order, so a given
+ * seed gives the same packets.
+ * Nothing else looks at the frame until tx_push() hands it over, so no
+ * lock is needed.
+ */
+void
+generate_pkt(control, rng, num, pkt)
+	struct TokenRingData *control;
+	struct random_data *rng;
+	int num;
+	struct data_pkt *pkt;
+{
+	int to, to_ring;
+
+	pkt->token_flag = '0';
+
+	pkt->to_group = control->cfg.n_groups > 0
+		&& gen_random(rng) % 100 < control->cfg.mcast_pct;
+	if (pkt->to_group) {
+		to_ring = control->cfg.ring;
+		to = gen_random(rng) % control->cfg.n_groups;
+	} else {
+		do {
+			to_ring = control->cfg.n_rings > 1 ?
+				gen_random(rng) % control->cfg.n_rings : 0;
+			to = gen_random(rng) % control->cfg.n_nodes;
+		} while (to == num && to_ring == control->cfg.ring);
+	}
+
+	pkt->to = (node_addr)to;
+	pkt->from = (node_addr)num;
+	pkt->to_ring = (node_addr)to_ring;
+	pkt->from_ring = (node_addr)control->cfg.ring;
+	pkt->length = (gen_random(rng) % control->cfg.max_len) + 1;
+	pkt->priority = control->cfg.n_prio > 1 ?
+		gen_random(rng) % control->cfg.n_prio : 0;
+	pkt->reservation = 0;
+	pkt->payload = pkt->data;
+
+	// initialize packet data with test content, then seal it
+	memcpy(pkt->data, fill_pattern, pkt->length);
+	pkt->fcs = frame_fcs(pkt, pkt->data);
+}
+
+/*
+ * Put the frame generate_pkt() has just filled in at the tail of node
+ * num's transmit queue for its priority, counting how deep the queues
+ * were when it arrived.  Only the generator that feeds node num may call
+ * this.  The releases on the tail and on pending are the whole handoff:
+ * a node's acquire load of either sees the complete frame.
+ */
+void
+tx_push(control, num, pkt)
+	struct TokenRingData *control;
+	int num;
+	struct data_pkt *pkt;
+{
+	struct node_data *node = &control->shared_ptr->node[num];
+	int depth = atomic_load_explicit(&node->pending, memory_order_relaxed);
+	int p = pkt->priority;
+	unsigned tail = atomic_load_explicit(&node->tx_tail[p], memory_order_relaxed);
+
+	node->queued++;
+	node->txq_sum += depth;
+	if (depth + 1 > node->txq_max) {
+		node->txq_max = depth + 1;
+	}
+	pkt->queued_at = ring_now(control);
+	node->txq[(size_t) p * control->cfg.txq_depth
+		+ tail % control->cfg.txq_depth] = pkt;
+	atomic_store_explicit(&node->tx_tail[p], tail + 1, memory_order_release);
+	atomic_fetch_add_explicit(&node->pending, 1, memory_order_release);
+}
+
 int
 runSimulation(control, numberOfPackets)
 	struct TokenRingData *control;
 	int numberOfPackets;
+{
+	if (control->cfg.perf && perf_start(control) < 0) {
+		return -1;
+	}
+	if (control->cfg.des) {
+		if (des_run(control, numberOfPackets) < 0) {
+			return -1;
+		}
+	} else {
+		if (startNodes(control) < 0) {
+			return -1;
+		}
+		generatePackets(control, numberOfPackets);
+		stopNodes(control);
+	}
+	perf_stop(control);
+
+	return 1;
+}
+
+/*
+ * Create threads that simulate the nodes.
+ * Store thread IDs and node numbers for each thread.
+ * Node threads need very little stack, and big rings run out of
+ * address space with the default size.
+ * With a worker pool the nodes are tasks instead, and the pool's
+ * threads are all there is.
+ */
+int
+startNodes(control)
+	struct TokenRingData *control;
 {
 	int i;
+	pthread_attr_t attr;
 
-	/*
-	 * Create threads that simulate the nodes.
-	 * Store thread IDs and node numbers for each thread
-	 */
-	for (i = 0; i < N_NODES; i++) {
-		control->node_numbers[i] = i;  
-		if (pthread_create(&control->threads[i], NULL, 
-			token_node, &control->thread_args[i]) != 0) {
-			panic("Thread creation failed for node %d\n", i);
+	if (control->cfg.rot_interval && rotation_start(control) < 0) {
+		return -1;
+	}
+	control->started = ring_now(control);
+	if (control->sched) {
+		if (sched_start(control) < 0) {
+			return -1;
+		}
+	} else {
+		if (pthread_attr_init(&attr) != 0
+				|| pthread_attr_setstacksize(&attr, NODE_STACK_SIZE) != 0) {
+			panic("Thread attribute setup failed\n");
 		}
+		for (i = 0; i < control->cfg.n_nodes; i++) {
+			control->node_numbers[i] = i;  
+			if (pthread_create(&control->threads[i], &attr, 
+				token_node, &control->thread_args[i]) != 0) {
+				panic("Thread creation failed for node %d\n", i);
+			}
 #ifdef DEBUG
-		fprintf(stderr, "Created thread for node %d\n", i);
+			fprintf(stderr, "Created thread for node %d\n", i);
 #endif
+		}
+		pthread_attr_destroy(&attr);
 	}
+	return 0;
+}
 
-	/*
-	 * Loop around generating packets at random.
-	 */
-	for (i = 0; i < numberOfPackets; i++) {
-#ifdef DEBUG
-		fprintf(stderr, "Main in generate packets\n");
-#endif
-		int num = random() % N_NODES;
+/*
+ * A packet generator and the shard of source nodes it feeds, first to
+ * first + n_nodes - 1.  Nothing else fills those nodes' transmit
+ * queues, so the generators never wait for each other.
+ */
+struct generator {
+	struct TokenRingData *control;
+	int		first;
+	int		n_nodes;
+	int		n_packets;
+	struct random_data *rng;
+	pthread_t	thread;
+	struct random_data own_rng;
+	char		rng_state[128];
+};
 
-		if (sem_wait(&control->sems[TO_SEND(num)]) < 0) {
-			panic("Wait sem failed errno=%d\n", errno);
-		}
-		if (sem_wait(&control->sems[CRIT]) < 0) {
-			panic("Wait sem failed errno=%d\n", errno);
-		}
+/*
+ * Generate a shard's packets, each for a random node of the shard.
+ */
+static void *
+generate_shard(arg)
+	void *arg;
+{
+	struct generator *gen = arg;
+	struct TokenRingData *control = gen->control;
+	struct data_pkt *pkt;
+	int i, num;
+
+	for (i = 0; i < gen->n_packets; i++) {
+		num = gen->first + gen_random(gen->rng) % gen->n_nodes;
 
-		if (control->shared_ptr->node[num].to_send.length > 0) {
-			sem_post(&control->sems[CRIT]);  
-			panic("to_send filled\n");
+		/*
+		 * TO_SEND(num) counts the free slots in the node's transmit
+		 * queue; when there are none we have to wait for the node to
+		 * get the token.
+		 */
+		if (SEM_TRYWAIT(control, TO_SEND(num)) < 0) {
+			if (errno != EAGAIN) {
+				panic("Wait sem failed errno=%d\n", errno);
+			}
+			control->shared_ptr->node[num].txq_full++;
+			if (SEM_WAIT(control, TO_SEND(num)) < 0) {
+				panic("Wait sem failed errno=%d\n", errno);
+			}
 		}
 
-		control->shared_ptr->node[num].to_send.token_flag = '0';
+		/*
+		 * Publish the frame to the node; its slot and the frame stay
+		 * taken until the node has put it on the ring and stripped it
+		 * again.
+		 */
+		pkt = pool_get_wait(control->frames);
+		generate_pkt(control, gen->rng, num, pkt);
+		TRACE(TR_QUEUE, num, pkt->length, 0, pkt->to);
+		tx_push(control, num, pkt);
+	}
+	return NULL;
+}
 
-		int to;
-		do {
-			to = random() % N_NODES;
-		} while (to == num);
-
-		control->shared_ptr->node[num].to_send.to = (char)to;
-		control->shared_ptr->node[num].to_send.from = (char)num;
-		control->shared_ptr->node[num].to_send.length = (random() % MAX_DATA) + 1;
-		
-		// initialize packet data with test content
-		for (int j = 0; j < control->shared_ptr->node[num].to_send.length; j++) {
-			control->shared_ptr->node[num].to_send.data[j] = 'A' + (j % 26);
-		}
+/*
+ * Generate packets at random, then wait for the nodes to have sent them
+ * all.  With cfg.generators > 1 the nodes are split into that many
+ * shards, each with a generator thread and random stream of its own;
+ * the calling thread runs the first, on the ring's stream.
+ */
+void
+generatePackets(control, numberOfPackets)
+	struct TokenRingData *control;
+	int numberOfPackets;
+{
+	struct generator *gens;
+	int i, n_gens = control->cfg.generators;
+	int n_nodes = control->cfg.n_nodes;
+	unsigned j;
 
-		if (sem_post(&control->sems[CRIT]) < 0) {
-			panic("Signal sem failed errno=%d\n", errno);
+	if (n_gens < 1) {
+		n_gens = 1;
+	}
+	if ((gens = calloc(n_gens, sizeof(struct generator))) == NULL) {
+		panic("Failed to allocate packet generators\n");
+	}
+	for (i = 0; i < n_gens; i++) {
+		gens[i].control = control;
+		gens[i].first = (int) ((long long) n_nodes * i / n_gens);
+		gens[i].n_nodes = (int) ((long long) n_nodes * (i + 1) / n_gens)
+			- gens[i].first;
+		gens[i].n_packets = (int) ((long long) numberOfPackets * (i + 1) / n_gens
+			- (long long) numberOfPackets * i / n_gens);
+		if (i == 0) {
+			gens[i].rng = &control->rng;
+			continue;
+		}
+		gens[i].rng = &gens[i].own_rng;
+		if (initstate_r(control->cfg.seed + control->cfg.ring + i * MAX_RINGS,
+				gens[i].rng_state, sizeof(gens[i].rng_state),
+				gens[i].rng) < 0) {
+			panic("Failed to seed packet generator %d\n", i);
 		}
-		if (sem_post(&control->sems[TO_SEND(num)]) < 0) {
-			panic("Signal sem failed errno=%d\n", errno);
+		if (pthread_create(&gens[i].thread, NULL, generate_shard,
+				&gens[i]) != 0) {
+			panic("Thread creation failed for packet generator %d\n", i);
+		}
+	}
+
+	generate_shard(&gens[0]);
+	for (i = 1; i < n_gens; i++) {
+		pthread_join(gens[i].thread, NULL);
+	}
+	free(gens);
+
+	/*
+	 * Wait for every node to hand back all its transmit queue slots,
+	 * so that all the generated packets are on the ring before we
+	 * shut it down.
+	 */
+	for (i = 0; i < n_nodes; i++) {
+		for (j = 0; j < control->cfg.txq_depth; j++) {
+			if (SEM_WAIT(control, TO_SEND(i)) < 0) {
+				panic("Wait sem failed errno=%d\n", errno);
+			}
 		}
 	}
+}
 
+/*
+ * Tell the nodes to terminate and wait for them.
+ */
+void
+stopNodes(control)
+    struct TokenRingData *control;
+{
+    int i;
+
+    control->stopped = ring_now(control);
 #ifdef DEBUG
     fprintf(stderr, "Setting termination flags for all nodes\n");
 #endif
-    if (sem_wait(&control->sems[CRIT]) < 0) {
+    if (SEM_WAIT(control, CRIT) < 0) {
         panic("Wait sem failed errno=%d\n", errno);
     }
     
-    control->shared_ptr->cleanup_in_progress = 1;
-    for (i = 0; i < N_NODES; i++) {
-        control->shared_ptr->node[i].terminate = 1;
+    atomic_store_explicit(&control->shared_ptr->cleanup_in_progress, 1,
+            memory_order_release);
+    for (i = 0; i < control->cfg.n_nodes; i++) {
+        atomic_store_explicit(&control->shared_ptr->node[i].terminate, 1,
+                memory_order_release);
 #ifdef DEBUG
         fprintf(stderr, "Set termination flag for node %d\n", i);
 #endif
@@ -239,6 +797,9 @@ runSimulation(control, numberOfPackets)
         sem_post(&control->sems[FILLED(i)]);
         sem_post(&control->sems[EMPTY(i)]);
         sem_post(&control->sems[TO_SEND(i)]);
+        if (control->links) {
+            spsc_link_wake(&control->links[i], control->cfg.wait_strategy);
+        }
     }
     
     if (sem_post(&control->sems[CRIT]) < 0) {
@@ -259,7 +820,8 @@ runSimulation(control, numberOfPackets)
 #endif
     
     // wait for threads with timeout
-    for (i = 0; i < N_NODES; i++) {
+    sched_stop(control);
+    for (i = 0; !control->sched && i < control->cfg.n_nodes; i++) {
         if (pthread_join(control->threads[i], NULL) != 0) {
 #ifdef DEBUG
             fprintf(stderr, "Warning: Thread %d join failed\n", i);
@@ -270,35 +832,498 @@ runSimulation(control, numberOfPackets)
 #endif
         }
     }
+    rotation_stop(control);
+}
 
-    return 1;
+/*
+ * How full the transmit queues got.  Only worth printing when there is
+ * more than one slot.
+ */
+static void
+txq_report(control)
+    struct TokenRingData *control;
+{
+    struct node_data *node;
+    long long queued = 0, sum = 0;
+    int i, max = 0, full = 0;
+
+    if (control->cfg.txq_depth < 2) {
+        return;
+    }
+
+    for (i = 0; i < control->cfg.n_nodes; i++) {
+        node = &control->shared_ptr->node[i];
+#ifdef DEBUG
+        fprintf(stderr, "Node %d: queued=%d mean depth=%.2f max depth=%d full=%d\n",
+            i, node->queued, node->queued ? (double) node->txq_sum / node->queued : 0.0,
+            node->txq_max, node->txq_full);
+#endif
+        queued += node->queued;
+        sum += node->txq_sum;
+        full += node->txq_full;
+        if (node->txq_max > max) {
+            max = node->txq_max;
+        }
+    }
+    if (control->cfg.n_rings > 1) {
+        printf("ring %d ", control->cfg.ring);
+    }
+    printf("txq: depth %u, %lld frames, mean depth on arrival %.2f, max %d, "
+        "generator waited on a full queue %d times\n", control->cfg.txq_depth,
+        queued, queued ? (double) sum / queued : 0.0, max, full);
+}
+
+/*
+ * How much of the frame pool was used.  Only printed when the pool was
+ * sized by hand, as otherwise it cannot run dry.
+ */
+static void
+pool_report(control)
+    struct TokenRingData *control;
+{
+    struct pool *pool = control->frames;
+
+    if (control->cfg.pool_frames == 0) {
+        return;
+    }
+    if (control->cfg.n_rings > 1) {
+        printf("ring %d ", control->cfg.ring);
+    }
+    printf("pool: %u frames of %zu bytes, high water %d, exhausted %d times\n",
+        pool->n_objs, pool->obj_size, atomic_load(&pool->high_water),
+        atomic_load(&pool->exhausted));
+}
+
+/*
+ * The virtual clock at the end of the run, in ps: when the last frame
+ * was back at its sender.
+ */
+static unsigned long long
+clock_end(control)
+    struct TokenRingData *control;
+{
+    unsigned long long end = 0;
+    int i;
+
+    if (control->cfg.des) {
+        return control->des_now * (control->cfg.byte_ps
+            + (control->cfg.link_delay ? 0 : control->cfg.prop_ps));
+    }
+    for (i = 0; i < control->cfg.n_nodes; i++) {
+        if (control->shared_ptr->node[i].vdone > end) {
+            end = control->shared_ptr->node[i].vdone;
+        }
+    }
+    return end;
+}
+
+/*
+ * How the token holding time worked out: frames sent per token capture,
+ * how much of the time the ring was carrying frames, and how long frames
+ * waited in their queues.  Utilisation is the bytes of the frames sent
+ * over the byte times the run took.  In byte mode every link moves a
+ * byte on each time round, so those are the handoffs over the nodes; in
+ * frame mode they come from the virtual clock or the discrete-event
+ * ticks.  A live frame mode ring has neither, and gets the bytes a
+ * second instead.  Fairness is Jain's index over the mean wait at each
+ * node that sent anything: 1 when they all waited alike, 1/n when one
+ * node took all the waiting.
+ */
+static void
+tht_report(control)
+    struct TokenRingData *control;
+{
+    struct node_data *node;
+    long long xfers = 0, sent = 0, captures = 0, bytes = 0;
+    unsigned long long wait_max = 0;
+    double wait_sum = 0, mean, sum = 0, sum_sq = 0, scale, line;
+    int i, senders = 0, held_max = 0;
+
+    if (!control->cfg.tht_report) {
+        return;
+    }
+
+    for (i = 0; i < control->cfg.n_nodes; i++) {
+        node = &control->shared_ptr->node[i];
+#ifdef DEBUG
+        fprintf(stderr, "Node %d: captures=%d held max=%d mean wait=%.0f\n", i,
+            node->captures, node->held_max,
+            node->sent ? (double) node->wait_sum / node->sent : 0.0);
+#endif
+        xfers += node->xfers;
+        sent += node->sent;
+        bytes += node->sent * FRAME_OVERHEAD + node->payload_sent;
+        captures += node->captures;
+        wait_sum += node->wait_sum;
+        if (node->wait_max > wait_max) {
+            wait_max = node->wait_max;
+        }
+        if (node->held_max > held_max) {
+            held_max = node->held_max;
+        }
+        if (node->sent) {
+            mean = (double) node->wait_sum / node->sent;
+            sum += mean;
+            sum_sq += mean * mean;
+            senders++;
+        }
+    }
+    scale = control->cfg.des ? 1.0 : 1e3;
+    if (control->cfg.xfer_mode == XFER_BYTE) {
+        line = (double) xfers / control->cfg.n_nodes;
+    } else if (control->cfg.byte_ps) {
+        line = (double) clock_end(control) / control->cfg.byte_ps;
+    } else if (control->cfg.des) {
+        line = control->des_now;
+    } else {
+        line = 0;
+    }
+    if (control->cfg.n_rings > 1) {
+        printf("ring %d ", control->cfg.ring);
+    }
+    if (control->cfg.tht_bytes) {
+        printf("tht: %u bytes", control->cfg.tht_bytes);
+    } else {
+        printf("tht: %u frames", control->cfg.tht_frames);
+    }
+    printf(", %lld captures, %.2f frames each (max %d), ", captures,
+        captures ? (double) sent / captures : 0.0, held_max);
+    if (line > 0) {
+        printf("utilisation %.1f%%", 100.0 * bytes / line);
+    } else {
+        printf("%.3f MB/s", control->stopped > control->started
+            ? bytes * 1e3 / (control->stopped - control->started) : 0.0);
+    }
+    printf(", wait mean %.1f max %.1f %s, fairness %.3f\n",
+        sent ? wait_sum / sent / scale : 0.0, wait_max / scale,
+        control->cfg.des ? "ticks" : "us",
+        sum_sq > 0 ? sum * sum / (senders * sum_sq) : 1.0);
 }
 
+/*
+ * How long frames of each priority waited to go out.
+ */
+static void
+prio_report(control)
+    struct TokenRingData *control;
+{
+    struct node_data *node;
+    unsigned long long wait, wait_max;
+    int i, p, sent;
+    double scale = control->cfg.des ? 1.0 : 1e3;
+
+    if (control->cfg.n_prio < 2) {
+        return;
+    }
+
+    for (p = control->cfg.n_prio - 1; p >= 0; p--) {
+        wait = wait_max = 0;
+        sent = 0;
+        for (i = 0; i < control->cfg.n_nodes; i++) {
+            node = &control->shared_ptr->node[i];
+            sent += node->prio_sent[p];
+            wait += node->prio_wait[p];
+            if (node->prio_wait_max[p] > wait_max) {
+                wait_max = node->prio_wait_max[p];
+            }
+        }
+        if (control->cfg.n_rings > 1) {
+            printf("ring %d ", control->cfg.ring);
+        }
+        printf("prio %d: %d frames, wait mean %.1f max %.1f %s\n", p, sent,
+            sent ? (double) wait / sent / scale : 0.0, wait_max / scale,
+            control->cfg.des ? "ticks" : "us");
+    }
+}
+
+/*
+ * How much multicast saved: each copy a member took would otherwise
+ * have been a frame, and a token capture, of its own.
+ */
+static void
+mcast_report(control)
+    struct TokenRingData *control;
+{
+    long sent = 0, received = 0;
+    int i;
+
+    if (control->cfg.n_groups == 0) {
+        return;
+    }
+
+    for (i = 0; i < control->cfg.n_nodes; i++) {
+        sent += control->shared_ptr->node[i].mcast_sent;
+        received += control->shared_ptr->node[i].mcast_received;
+    }
+    if (control->cfg.n_rings > 1) {
+        printf("ring %d ", control->cfg.ring);
+    }
+    printf("mcast: %d groups, %ld frames delivered %ld times, "
+        "%.1f copies each, %ld frames saved\n", control->cfg.n_groups,
+        sent, received, sent ? (double) received / sent : 0.0,
+        received - sent);
+}
+
+/*
+ * With the virtual clock, the simulated time the run took, the payload
+ * throughput and the token rotation time.  The run took until the last
+ * frame was back at its sender, or in the discrete-event engine until
+ * its last event, its ticks being byte times with a link delay and
+ * whole handoffs without.
+ */
+static void
+clock_report(control)
+    struct TokenRingData *control;
+{
+    struct node_data *node;
+    unsigned long long end, rot_sum = 0, rot_max = 0;
+    long long payload = 0;
+    long rot_n = 0;
+    double seconds, mbps;
+    int i;
+
+    if (!control->cfg.byte_ps) {
+        return;
+    }
+
+    for (i = 0; i < control->cfg.n_nodes; i++) {
+        node = &control->shared_ptr->node[i];
+        payload += node->payload_sent;
+        rot_sum += node->rot_sum;
+        rot_n += node->rot_n;
+        if (node->rot_max > rot_max) {
+            rot_max = node->rot_max;
+        }
+    }
+    end = clock_end(control);
+    seconds = end / 1e12;
+    mbps = seconds > 0 ? payload * 8 / seconds / 1e6 : 0.0;
+
+    if (control->cfg.n_rings > 1) {
+        printf("ring %d ", control->cfg.ring);
+    }
+    printf("clock: %g Mb/s, %.3f ms, payload %.3f Mb/s (%.1f%% of the line), "
+        "token rotation mean %.1f max %.1f us\n", control->cfg.line_rate,
+        seconds * 1e3, mbps, 100.0 * mbps / control->cfg.line_rate,
+        rot_n ? rot_sum / 1e6 / rot_n : 0.0, rot_max / 1e6);
+}
+
+/*
+ * One line of latency percentiles.
+ */
+static void
+latency_line(control, who, h)
+    struct TokenRingData *control;
+    const char *who;
+    const struct hist *h;
+{
+    double scale = control->cfg.des ? 1.0 : 1e3;
+
+    printf("  %-8s %8llu  %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", who,
+        h->count, h->count ? h->sum / scale / h->count : 0.0,
+        hist_percentile(h, 50.0) / scale, hist_percentile(h, 90.0) / scale,
+        hist_percentile(h, 99.0) / scale, hist_percentile(h, 99.9) / scale,
+        h->max / scale);
+}
+
+/*
+ * Percentiles of how long frames took: queueing from being generated
+ * to reaching the head of their queue, access from there to going out
+ * on the ring, and delivery from being generated to being taken in at
+ * the destination, the last counted at each receiver.  Each node kept
+ * histograms of its own; the ring line merges them.
+ */
+static void
+latency_report(control)
+    struct TokenRingData *control;
+{
+    static const char *names[N_LAT] = { "queue", "access", "delivery" };
+    struct hist ring;
+    char who[16];
+    int i, m;
+
+    if (!control->cfg.latency) {
+        return;
+    }
+
+    for (m = 0; m < N_LAT; m++) {
+        memset(&ring, 0, sizeof(ring));
+        for (i = 0; i < control->cfg.n_nodes; i++) {
+            hist_merge(&ring, &control->shared_ptr->node[i].lat[m]);
+        }
+        if (control->cfg.n_rings > 1) {
+            printf("ring %d ", control->cfg.ring);
+        }
+        printf("latency %s (%s):\n  %-8s %8s  %10s %10s %10s %10s %10s %10s\n",
+            names[m], control->cfg.des ? "ticks" : "us", "node", "frames",
+            "mean", "p50", "p90", "p99", "p99.9", "max");
+        latency_line(control, "ring", &ring);
+        for (i = 0; i < control->cfg.n_nodes; i++) {
+            snprintf(who, sizeof(who), "%d", i);
+            latency_line(control, who, &control->shared_ptr->node[i].lat[m]);
+        }
+    }
+}
+
+#ifdef SEM_STATS
+static void
+sem_json(f, st)
+    FILE *f;
+    const struct sem_stats *st;
+{
+    fprintf(f, "{ \"acquired\": %llu, \"contended\": %llu, "
+        "\"blocked_ns\": %llu }", st->acquired, st->contended,
+        st->blocked_ns);
+}
+
+static void
+sem_add(sum, st)
+    struct sem_stats *sum;
+    const struct sem_stats *st;
+{
+    sum->acquired += st->acquired;
+    sum->contended += st->contended;
+    sum->blocked_ns += st->blocked_ns;
+}
+
+/*
+ * Write the semaphore counts to SEM_STATS_FILE, with the ring number
+ * after the name on a campus: CRIT, every node's three semaphores, and
+ * each kind added up over the ring.  EMPTY(n) is waited on by the node
+ * before n, sending to it, FILLED(n) by n itself and TO_SEND(n) by the
+ * generator, so a node's own blocked time is its FILLED plus the next
+ * node's EMPTY.
+ */
+static void
+sem_report(control)
+    struct TokenRingData *control;
+{
+    static const char *kinds[3] = { "empty", "filled", "to_send" };
+    struct sem_stats *stats = control->sem_stats, sum[3];
+    int n = control->cfg.n_nodes, i, k, idx[3];
+    char name[4096];
+    FILE *f;
+
+    if (control->cfg.n_rings > 1) {
+        snprintf(name, sizeof(name), "%s.%d", SEM_STATS_FILE,
+            control->cfg.ring);
+    } else {
+        snprintf(name, sizeof(name), "%s", SEM_STATS_FILE);
+    }
+    if ((f = fopen(name, "w")) == NULL) {
+        fprintf(stderr, "Cannot write semaphore counts to %s: %s\n", name,
+            strerror(errno));
+        return;
+    }
+
+    memset(sum, 0, sizeof(sum));
+    fprintf(f, "{\n  \"crit\": ");
+    sem_json(f, &stats[CRIT]);
+    fprintf(f, ",\n  \"node\": [\n");
+    for (i = 0; i < n; i++) {
+        idx[0] = EMPTY(i);
+        idx[1] = FILLED(i);
+        idx[2] = TO_SEND(i);
+        fprintf(f, "    { \"node\": %d", i);
+        for (k = 0; k < 3; k++) {
+            fprintf(f, ", \"%s\": ", kinds[k]);
+            sem_json(f, &stats[idx[k]]);
+            sem_add(&sum[k], &stats[idx[k]]);
+        }
+        fprintf(f, ", \"blocked_ns\": %llu }%s\n",
+            stats[FILLED(i)].blocked_ns + stats[EMPTY((i + 1) % n)].blocked_ns,
+            i + 1 < n ? "," : "");
+    }
+    fprintf(f, "  ],\n  \"ring\": {");
+    for (k = 0; k < 3; k++) {
+        fprintf(f, "%s \"%s\": ", k ? "," : "", kinds[k]);
+        sem_json(f, &sum[k]);
+    }
+    fprintf(f, " }\n}\n");
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Cannot write semaphore counts to %s: %s\n", name,
+            strerror(errno));
+        return;
+    }
+
+    if (control->cfg.n_rings > 1) {
+        printf("ring %d ", control->cfg.ring);
+    }
+    printf("sem: blocked %.3f ms sending, %.3f ms receiving, generator "
+        "%.3f ms; counts in %s\n", sum[0].blocked_ns / 1e6,
+        sum[1].blocked_ns / 1e6, sum[2].blocked_ns / 1e6, name);
+}
+#endif
+
 int
 cleanupSystem(control)
     struct TokenRingData *control;
 {
-    int i;
+    int i, fcs_errors = 0;
 
     // print results
-    for (i = 0; i < N_NODES; i++) {
+    for (i = 0; i < control->cfg.n_nodes; i++) {
 #ifdef DEBUG
         fprintf(stderr, "Node %d: sent=%d received=%d\n", i,
             control->shared_ptr->node[i].sent,
             control->shared_ptr->node[i].received);
 #endif
+        fcs_errors += control->shared_ptr->node[i].fcs_errors;
+    }
+    if (fcs_errors > 0) {
+        if (control->cfg.n_rings > 1) {
+            printf("ring %d ", control->cfg.ring);
+        }
+        printf("fcs: %d frames failed the frame check\n", fcs_errors);
     }
 
+    txq_report(control);
+    pool_report(control);
+    tht_report(control);
+    prio_report(control);
+    mcast_report(control);
+    clock_report(control);
+    latency_report(control);
+    rotation_report(control);
+#ifdef SEM_STATS
+    sem_report(control);
+#endif
+    perf_report(control);
+    sched_destroy(control);
+
     fflush(stdout);
     fflush(stderr);
 
     // semaphores and memory
-    for (i = 0; i < NUM_SEM; i++) {
-        sem_destroy(&control->sems[i]);
+    destroy_sems(control, control->cfg.n_nodes);
+
+    if (control->links) {
+        for (i = 0; i < control->cfg.n_nodes; i++) {
+            spsc_link_destroy(&control->links[i]);
+        }
+        free(control->links);
     }
+    if (control->bridge) {
+        pthread_mutex_destroy(&control->bridge->lock);
+        free(control->bridge->pkts);
+        free(control->bridge);
+    }
+    pool_destroy(control->frames);
+    free(control->frames);
+    free(control->groups);
 
     free(control->thread_args);
+    free(control->node_numbers);
+    free(control->threads);
     free(control->sems);
+#ifdef SEM_STATS
+    free(control->sem_stats);
+#endif
+    free_link_slots(control);
+    free(control->shared_ptr->link);
+    free(control->shared_ptr->node);
+    free(control->shared_ptr->txq);
+    free(control->shared_ptr->lat);
     free(control->shared_ptr);
     free(control);
 
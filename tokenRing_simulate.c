@@ -55,6 +55,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
+#include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include "tokenRing.h"
@@ -86,201 +88,507 @@ int join_thread_with_timeout(pthread_t thread, void **retval, struct timespec *t
 }
 
 /*
- * This function is the body of a child process emulating a node.
+ * Put a free token on the ring in frame mode, giving up the one we
+ * held with reservation res (see token_release()).
  */
-void *token_node(void *arg) {
-    struct TokenRingData *control = ((struct token_args *)arg)->control;
-    int num = ((struct token_args *)arg)->node_num;
-    
-    // state tracking variables
-    int rcv_state = TOKEN_FLAG, not_done = 1, sending = 0, len;
-    unsigned char byte;
-    // node role flags
-    char producer, consumer;
+static void
+send_token(control, num, res)
+    struct TokenRingData *control;
+    int num;
+    int res;
+{
+    struct data_pkt token;
+
+    control->shared_ptr->node[num].idle++;
+    token_release(control, num, res, &token);
+    token.length = 0;
+    token.fcs = 0;
+    token.payload = NULL;
+    send_frame(control, num, &token);
+}
+
+/*
+ * Get the ring going: node #0 creates the token, and with a link delay
+ * every node puts its share of fill on its outbound link behind it.
+ */
+void
+token_node_start(control, num)
+    struct TokenRingData *control;
+    int num;
+{
+    unsigned i = 0;
 
-    /*
-     * If this is node #0, start the ball rolling by creating the
-     * token.
-     */
     if (num == 0) {
-        send_byte(control, num, '0');  
-#ifdef DEBUG
-    fprintf(stderr, "YUH FIRST TOKEN @ THE NODE #%d.\n", num);
-#endif
+        if (control->cfg.xfer_mode == XFER_FRAME) {
+            send_token(control, num, 0);
+        } else {
+            control->shared_ptr->node[num].idle++;
+            send_byte(control, num, '0');
+        }
+        i = 1;
     }
-    /*
-     * Loop around processing data, until done.
-     */
-    while (not_done) {
-        // check termination flag 
-        if (sem_wait(&control->sems[CRIT]) < 0) {
-            panic("Wait sem failed errno=%d\n", errno);
-        }
-        if (control->shared_ptr->node[num].terminate || 
-            control->shared_ptr->cleanup_in_progress) {
-#ifdef DEBUG
-            fprintf(stderr, "Node %d: Detected terminate flag, breaking loop\n", num);
-#endif
-            sem_post(&control->sems[CRIT]);
-            not_done = 0;
-            break;
+    TRACE(TR_START, num, i ? '0' : 0, 0, 0);
+    for (; i < control->cfg.link_delay; i++) {
+        control->shared_ptr->node[num].idle++;
+        send_byte(control, num, FILL_BYTE);
+    }
+}
+
+/*
+ * Send the frame at the head of node num's transmit queue, on a token
+ * it has just taken or is still holding.
+ */
+static void
+send_head(control, num)
+    struct TokenRingData *control;
+    int num;
+{
+    struct data_pkt *to_send = tx_start(control, num);
+
+    to_send->token_flag = '1';
+    to_send->refused = 0;
+    TRACE(TR_FRAME_START, num, to_send->length, 0, to_send->to);
+    // the bridge's own frames for other rings never go past it
+    if (control->bridge && num == BRIDGE_NODE
+            && to_send->to_ring != control->cfg.ring) {
+        to_send->refused = !bridge_forward(control, to_send);
+    }
+    send_frame(control, num, to_send);
+}
+
+/*
+ * Whether the bridge, holding the token, may put another frame from its
+ * bridge queue on the ring in place of pkt, and if so takes it into pkt.
+ * The token holding time limits these as it does a node's own frames
+ * (see tx_more()), but apart from them: a bridge whose own frames are
+ * refused by another ring must still empty its queue, or the rings can
+ * end up waiting on each other.  For the same reason the token's
+ * priority does not hold them back.  The reservations pkt collected go
+ * on with the new frame.
+ */
+static int
+bridge_more(control, num, pkt)
+    struct TokenRingData *control;
+    int num;
+    struct data_pkt *pkt;
+{
+    struct node_state *st = &control->shared_ptr->node[num].state;
+    int res = pkt->reservation;
+
+    if (control->cfg.tht_frames
+            && st->bridged >= (int) control->cfg.tht_frames)
+        return 0;
+    if (!bridge_take(control, pkt, st->bridged == 0 || !control->cfg.tht_bytes
+                ? INT_MAX : (int) control->cfg.tht_bytes - st->bridged_bytes))
+        return 0;
+    st->bridged++;
+    st->bridged_bytes += pkt->length;
+    pkt->reservation = res;
+    return 1;
+}
+
+/*
+ * Node num's frame has come back or reached its destination: free its
+ * queue slot.
+ */
+static void
+frame_done(control, num)
+    struct TokenRingData *control;
+    int num;
+{
+    control->shared_ptr->node[num].vdone = control->shared_ptr->node[num].vnow;
+    tx_pop(control, num);
+    if (sem_post(&control->sems[TO_SEND(num)]) < 0) {
+        panic("Signal sem failed errno=%d\n", errno);
+    }
+}
+
+/*
+ * Virtual clock: node num takes pkt off the ring rather than passing it
+ * on.  Its clock has the first byte in, and moves on to the last.
+ */
+static void
+vclock_strip(control, num, pkt)
+    struct TokenRingData *control;
+    int num;
+    const struct data_pkt *pkt;
+{
+    if (control->cfg.byte_ps) {
+        control->shared_ptr->node[num].vnow += (FRAME_WIRE_BYTES(pkt) - 1)
+                * control->cfg.byte_ps;
+    }
+}
+
+/*
+ * Frame mode handling of one frame arriving at a node.  Each handoff
+ * carries a whole frame, so the TO/FROM/LEN/DATA states collapse into
+ * looking at the header of what arrived: a token is either captured or
+ * passed on, our own frame coming back round is stripped and followed
+ * by a fresh token, and anything else is forwarded.  Exactly one frame
+ * goes out for each one that comes in.
+ *
+ * With destination stripping (cfg.dest_strip) the destination takes the
+ * frame off the ring and sends a free token on in its place, so the
+ * links past it never see the frame.  The sender finds out through its
+ * delivered flag the next time anything reaches it, and until then
+ * does not take the token again.  Together with early token release
+ * the destination sends nothing on, and nodes on parts of the ring no
+ * frame is crossing can send at the same time (spatial reuse).
+ *
+ * A node holding the token may send the next frame in its queue in
+ * place of the one it strips, for as long as the token holding time
+ * lets it (see tx_more()).
+ *
+ * Tokens and frames carry an access priority and a reservation, and
+ * each node keeps a transmit queue per priority.  A node only takes a
+ * token for a frame of at least the token's priority, and otherwise
+ * asks for a later token at its own priority through the reservation
+ * field of whatever goes past (see token_capture(), token_release()).
+ *
+ * On a campus the bridge node also sends the frames waiting in its
+ * bridge queue when it takes the token, taking turns with its own
+ * frames, and after its own for as long as the token holding time lets
+ * it (see bridge_more()).  It strips them when they come back (they are the
+ * only frames from other rings on this ring), and copies frames for
+ * other rings into their queues as they go past, marking those it
+ * finds no room for refused.  A sender keeps a refused frame at the
+ * head of its queue and sends it again.
+ *
+ * With early token release (cfg.etr) a node sends a free token straight
+ * after its frame instead of in place of it when it comes back, so
+ * frames from several nodes can be going round at once.  Stripping a
+ * frame then sends nothing on.  A node does not take the token again
+ * until its last frame is back, which keeps at most one frame per node
+ * and the token on the ring: fewer than the links and nodes can hold
+ * between them, so nobody can wait forever for room.
+ */
+void
+token_node_frame(control, num, pkt)
+    struct TokenRingData *control;
+    int num;
+    struct data_pkt *pkt;
+{
+    struct node_state *st = &control->shared_ptr->node[num].state;
+    int have_pkt, prio, res;
+    int ring = control->cfg.ring;
+    int bridge = control->bridge && num == BRIDGE_NODE;
+
+    if (st->in_flight && control->cfg.dest_strip
+            && atomic_load_explicit(&control->shared_ptr->node[num].delivered,
+                memory_order_acquire)) {
+        atomic_store_explicit(&control->shared_ptr->node[num].delivered, 0,
+                memory_order_relaxed);
+        st->in_flight = 0;
+        frame_done(control, num);
+    }
+
+    if (pkt->token_flag == '0') {
+        have_pkt = !st->in_flight && token_capture(control, num, pkt);
+        token_seen(control, num, have_pkt);
+        TRACE(TR_TOKEN, num, have_pkt, 0, 0);
+        prio = pkt->priority;
+        res = pkt->reservation;
+        if (bridge && !st->in_flight && (!have_pkt || st->bridge_turn)
+                && bridge_take(control, pkt, INT_MAX)) {
+            // a bridge puts a frame from its queue in place of a token
+            // of any priority, since other rings wait for the room it
+            // frees, and takes turns with its own frames
+            st->bridge_turn = 0;
+            st->token_prio = prio;
+            st->bridged = 1;
+            st->bridged_bytes = pkt->length;
+            pkt->reservation = res;
+            send_frame(control, num, pkt);
+        } else if (have_pkt) {
+            st->bridge_turn = bridge;
+            send_head(control, num);
+        } else {
+            control->shared_ptr->node[num].idle++;
+            send_frame(control, num, pkt);
+            return;
         }
-        sem_post(&control->sems[CRIT]);
-        
-        // if not terminating we can proceed    
-        if (not_done) {
-            byte = rcv_byte(control, num); // get byte from previous node
-#ifdef DEBUG
-            fprintf(stderr, "@ Node %d: Received byte 0x%02X in state %d\n", num, byte, rcv_state);
-#endif
-            /*
-             * Handle the byte, based upon current state.
-             */
-            switch (rcv_state) {
-            case TOKEN_FLAG:
-                // check if node can send data
-                if (sem_wait(&control->sems[CRIT]) < 0) {
-                    panic("Wait sem failed errno=%d\n", errno);
-                }
-#ifdef DEBUG
-                fprintf(stderr, "@ Node %d: Token check - current token_flag=%c\n", 
-                        num, control->shared_ptr->node[num].to_send.token_flag);
-#endif
-                if (byte == '0'){
-                    if (control->shared_ptr->node[num].to_send.token_flag == '0') {
-                        producer = 1;
-                        consumer = 0;
-                    } 
-                    else {
-                        producer = 0;
-                        consumer = 1;
-                    }
+        if (control->cfg.etr || control->cfg.dest_strip) {
+            // the token is not ours any more
+            st->in_flight = 1;
+            st->held = 0;
+        }
+        if (control->cfg.etr) {
+            send_token(control, num, 0);
+        }
+    } else if (pkt->from == num && pkt->from_ring == ring) {
+        // our frame is back: strip it and release the token
+        TRACE(TR_STRIP, num, pkt->length, 0, pkt->to);
+        vclock_strip(control, num, pkt);
+        // a refused frame stays at the head of the queue to go again
+        if (!pkt->refused) {
+            frame_done(control, num);
+        }
+        if (control->cfg.etr) {
+            // the token went out right behind it
+            st->in_flight = 0;
+            return;
+        }
+        if (tx_more(control, num)) {
+            send_head(control, num);
+            return;
+        }
+        if (bridge && bridge_more(control, num, pkt)) {
+            send_frame(control, num, pkt);
+            return;
+        }
+        send_token(control, num, pkt->reservation);
+    } else if (bridge && pkt->from_ring != ring) {
+        // a frame we brought in from another ring is back
+        vclock_strip(control, num, pkt);
+        bridge_stripped(control);
+        if (control->cfg.etr) {
+            st->in_flight = 0;
+            return;
+        }
+        if (bridge_more(control, num, pkt)) {
+            send_frame(control, num, pkt);
+            return;
+        }
+        send_token(control, num, pkt->reservation);
+    } else {
+        if (pkt_for(control, num, pkt)) {
+            frame_check(control, num, pkt);
+            if (control->cfg.dest_strip) {
+                // ours: take it off and tell the sender
+                TRACE(TR_DEST_STRIP, num, pkt->length, 0, pkt->from);
+                vclock_strip(control, num, pkt);
+                atomic_store_explicit(&control->shared_ptr->node[pkt->from].delivered,
+                        1, memory_order_release);
+                if (!control->cfg.etr) {
+                    send_token(control, num, 0);
                 }
+                return;
+            }
+        } else if (bridge && pkt->to_ring != ring
+                && !bridge_forward(control, pkt)) {
+            pkt->refused = 1;
+        }
+        if (control->cfg.n_prio > 1) {
+            frame_reserve(control, num, pkt);
+        }
+        send_frame(control, num, pkt);
+    }
+}
 
-                if (sem_post(&control->sems[CRIT]) < 0) {
-                    panic("Signal sem failed errno=%d\n", errno);
-                }
-                
-                if (byte == '0') {
-                    if (producer == 1 && consumer == 0) {
-#ifdef DEBUG
-                    fprintf(stderr, "@ Node %d: Starting to send packet\n", num);
-#endif
-                        control->snd_state = TOKEN_FLAG;
-                        send_pkt(control, num);
-                        rcv_state = TO;
-                    }
-                    else {
-                        if (sem_wait(&control->sems[CRIT]) < 0) {
-                            panic("Wait sem failed errno=%d\n", errno);
-                        }
-
-                        if (control->shared_ptr->node[num].terminate == 1) {
-#ifdef DEBUG
-                            fprintf(stderr, "KILLING MY SON/CHILD: %d\n", num);
-#endif
-                            not_done = 0;
-                        }
-                        if (sem_post(&control->sems[CRIT]) < 0) {
-                            panic("Signal sem failed errno=%d\n", errno);
-                        }
-                        send_byte(control, num, byte);
-                        rcv_state = TOKEN_FLAG;
-                    }
-                } 
-                else {
-                    send_byte(control, num, byte);
-                    rcv_state = TO;
-                }
-                break;
+/*
+ * Byte mode: the last FCS byte of a frame for node num has gone past.
+ * The same as frame_check(), on the CRC the node worked out as the
+ * frame came in.
+ */
+static void
+frame_check_byte(control, num)
+    struct TokenRingData *control;
+    int num;
+{
+    struct node_data *node = &control->shared_ptr->node[num];
+    struct node_state *st = &node->state;
 
-            case TO:
-                // handle destination address
-                rcv_state = FROM;
-                if (producer == 1 && consumer == 0) {
-                    send_pkt(control, num);
-                } 
-                else {
-                    send_byte(control, num, byte);
-                }
-                break;
+    if (st->crc != st->fcs) {
+        node->fcs_errors++;
+        TRACE(TR_BAD_FCS, num, st->len, st->rcv_state, st->from);
+        return;
+    }
+    node->received++;
+    node->mcast_received += st->group;
+    if (control->cfg.latency) {
+        // the frame is still at the head of its sender's queue
+        hist_record(&node->lat[LAT_DELIVERY], ring_now(control)
+                - control->shared_ptr->node[st->from].tx_queued_at);
+    }
+    TRACE(TR_DELIVER, num, st->len, st->rcv_state, st->from);
+}
 
-            case FROM:
-                // handle source address
-                rcv_state = LEN;
-                if (producer == 1 && consumer == 0) {
-                    send_pkt(control, num);
-                } 
-                else {
-                    send_byte(control, num, byte);
-                }
-                break;
+/*
+ * Byte mode handling of one byte arriving at a node, based upon the
+ * node's receive state.  Exactly one byte goes out for each one that
+ * comes in.  Returns 0 once the node should stop.
+ *
+ * A node sending a frame takes off everything that comes in until the
+ * last byte of its frame is back: the fill that was on the ring behind
+ * the token (none without a link delay), then the frame itself.  It
+ * puts out the rest of its frame in their place, and fill once the
+ * frame is all out.
+ */
+int
+token_node_byte(control, num, byte)
+    struct TokenRingData *control;
+    int num;
+    unsigned byte;
+{
+    struct node_state *st = &control->shared_ptr->node[num].state;
 
-            case LEN:
-                // process packet length and prepare for data
-                if (producer == 1 && consumer == 0) {
-                    send_pkt(control, num);
-                    if (sem_wait(&control->sems[CRIT]) < 0) {
-                        panic("Wait sem failed errno=%d\n", errno);
-                    }
-                    len = control->shared_ptr->node[num].to_send.length;
-                    if (sem_post(&control->sems[CRIT]) < 0) {
-                        panic("Signal sem failed errno=%d\n", errno);
-                    }
-                }
-                else {
-                    send_byte(control, num, byte);
-                    len = (int) byte;
-                }
-                sending = 0;
-                if (len > 0) {
-                    rcv_state = DATA;
-                }
-                else {
-                    rcv_state = TOKEN_FLAG;
-                }
-                break;
+    if (st->producer) {
+        if (st->snd_state != TOKEN_FLAG) {
+            send_pkt(control, num);
+        } else {
+            control->shared_ptr->node[num].idle++;
+            send_byte(control, num, FILL_BYTE);
+        }
+        if (--st->strip == 0) {
+            // all but the trailer is back: the next byte is the last
+            frame_done(control, num);
+            st->producer = 0;
+            st->rcv_state = TOKEN_FLAG;
+        }
+        return 1;
+    }
 
-            case DATA:
-                // transfer packet data bytes
-#ifdef DEBUG
-                fprintf(stderr, "@ Node %d: Processing DATA, sending=%d, len=%d\n", 
-                        num, sending, len);
-#endif
-                if (sending < (len-1)) {
-                    if (producer == 1 && consumer == 0) {
-                        send_pkt(control, num);
-                    }
-                    else {
-                        send_byte(control, num, byte);
-                    }    
-                    rcv_state = DATA;
+    switch (st->rcv_state) {
+    case TOKEN_FLAG:
+        // check if node can send data
+        if (byte == FILL_BYTE) {
+            control->shared_ptr->node[num].idle++;
+            send_byte(control, num, byte);
+        }
+        else if (byte == '0') {
+            if (st->held) {
+                // our own token back behind our frame: keep it for the
+                // next one or pass it on
+                st->producer = tx_more(control, num);
+                if (!st->producer) {
+                    st->held = 0;
                 }
-                else {
-                    if (producer == 1 && consumer == 0) {
-                        send_pkt(control, num);
-                    }
-                    else {
-                        send_byte(control, num, byte);
-                    }
-                    producer = 0;
-                    consumer = 1;
-                    rcv_state = TOKEN_FLAG;
+            } else {
+                st->producer = atomic_load_explicit(&control->shared_ptr->node[num].pending,
+                        memory_order_acquire) != 0;
+                token_seen(control, num, st->producer);
+            }
+            TRACE(TR_TOKEN, num, st->producer, st->rcv_state, 0);
+            if (st->producer) {
+                st->snd_state = TOKEN_FLAG;
+                send_pkt(control, num);
+                st->strip = (control->cfg.link_delay
+                        ? control->cfg.n_nodes * control->cfg.link_delay - 1 : 0)
+                        + 1 + 2 * ADDR_BYTES + 1 + st->sndlen + FCS_BYTES;
+            }
+            else {
+                control->shared_ptr->node[num].idle++;
+                send_byte(control, num, byte);
+                if (node_terminating(control, num)) {
+                    return 0;
                 }
-                sending++;
+            }
+        } 
+        else {
+            // a frame, '2' if it is for a group
+            st->group = byte == '2';
+            st->mine = 0;
+            send_byte(control, num, byte);
+            st->rcv_state = TO;
+        }
+        break;
+
+    case TO:
+        // handle destination address, ADDR_BYTES long
+        st->addr = (st->addr << 8) | byte;
+        if (++st->hdrpos == ADDR_BYTES) {
+            st->rcv_state = FROM;
+            st->hdrpos = 0;
+            st->to = st->addr;
+            st->mine = st->group ? mcast_member(control, st->addr, num)
+                : st->addr == num;
+            st->addr = 0;
+        }
+        send_byte(control, num, byte);
+        break;
+
+    case FROM:
+        // handle source address, ADDR_BYTES long
+        st->addr = (st->addr << 8) | byte;
+        if (++st->hdrpos == ADDR_BYTES) {
+            st->rcv_state = LEN;
+            st->hdrpos = 0;
+            st->from = st->addr;
+            st->addr = 0;
+        }
+        send_byte(control, num, byte);
+        break;
+
+    case LEN:
+        // process packet length and prepare for data
+        send_byte(control, num, byte);
+        st->len = (int) byte;
+        st->sending = 0;
+        st->rcv_state = st->len > 0 ? DATA : FCS;
+        st->fcs = 0;
+        if (st->mine) {
+            // byte mode frames never leave the ring they start on
+            st->crc = fcs_header(st->to, st->from, control->cfg.ring,
+                    control->cfg.ring, st->group, st->len);
+        }
+        break;
+
+    case DATA:
+        // transfer packet data bytes
+        send_byte(control, num, byte);
+        if (st->mine) {
+            unsigned char b = byte;
+
+            st->crc = crc32c(st->crc, &b, 1);
+        }
+        if (++st->sending == st->len) {
+            st->rcv_state = FCS;
+        }
+        break;
+
+    case FCS:
+        // the frame check sequence, high byte first; the frame only
+        // counts as received once it checks out
+        send_byte(control, num, byte);
+        st->fcs = (st->fcs << 8) | byte;
+        if (++st->hdrpos < FCS_BYTES) {
+            break;
+        }
+        st->hdrpos = 0;
+        st->rcv_state = DONE;
+        if (st->mine) {
+            frame_check_byte(control, num);
+        }
+        break;
+
+    case DONE:
+        // the sender's token right behind its frame, on its way back
+        // to the sender: not ours to take
+        send_byte(control, num, byte);
+        st->rcv_state = TOKEN_FLAG;
+        break;
+    };
+    return 1;
+}
+
+/*
+ * This function is the body of a thread emulating a node: it blocks on
+ * its inbound link and hands what arrives to the state machine.
+ */
+void *token_node(void *arg) {
+    struct TokenRingData *control = ((struct token_args *)arg)->control;
+    int num = ((struct token_args *)arg)->node_num;
+    struct data_pkt pkt;
+
+    token_node_start(control, num);
+
+    /*
+     * Loop around processing data, until done.
+     */
+    if (control->cfg.xfer_mode == XFER_FRAME) {
+        while (rcv_frame(control, num, &pkt)) {
+            token_node_frame(control, num, &pkt);
+        }
+    } else {
+        while (!node_terminating(control, num)) {
+            if (!token_node_byte(control, num, rcv_byte(control, num))) {
                 break;
-            };
+            }
         }
     }
-#ifdef DEBUG
-    fprintf(stderr, "@ Node %d: Terminating\n", num);
-#endif
+    TRACE(TR_STOP, num, 0, 0, 0);
 
     fflush(stdout);
-    
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Clean exit\n", num);
-#endif
     pthread_exit(NULL);
     return NULL;  
 }
@@ -294,174 +602,415 @@ send_pkt(control, num)
     struct TokenRingData *control;
     int num;
 {
-    // packet sending state variables
-    static int sndpos, sndlen, node_index;  
+    struct node_state *st = &control->shared_ptr->node[num].state;
+    struct data_pkt *to_send = tx_head(control, num);
 
-    switch (control->snd_state) {
+    switch (st->snd_state) {
     case TOKEN_FLAG:
         // start packet transmission with token
-#ifdef DEBUG
-        fprintf(stderr, "@ Node %d: Sending packet header\n", num);
-#endif
-        if (sem_wait(&control->sems[CRIT]) < 0) {
-            panic("Wait sem failed errno=%d\n", errno);
-        }
-        control->shared_ptr->node[num].sent++;
-        node_index = (int) control->shared_ptr->node[num].to_send.to; // get destination node
-        control->shared_ptr->node[node_index].received++; 
-        control->shared_ptr->node[num].to_send.token_flag = '1';
-        if (sem_post(&control->sems[CRIT]) < 0) {
-            panic("Signal sem failed errno=%d\n", errno);
-        }
-        
-        send_byte(control, num, control->shared_ptr->node[num].to_send.token_flag);
-        control->snd_state = TO;
-        sndpos = 0;
+        to_send = tx_start(control, num);
+        to_send->token_flag = to_send->to_group ? '2' : '1';
+        TRACE(TR_FRAME_START, num, to_send->length, TOKEN_FLAG, to_send->to);
         
-        if (sem_wait(&control->sems[CRIT]) < 0) {
-            panic("Wait sem failed errno=%d\n", errno);
-        }
-        sndlen = control->shared_ptr->node[num].to_send.length;
-        if (sem_post(&control->sems[CRIT]) < 0) {
-            panic("Signal sem failed errno=%d\n", errno);
-        }
+        send_byte(control, num, to_send->token_flag);
+        st->snd_state = TO;
+        st->sndpos = 0;
+        st->snd_hdrpos = 0;
+        st->sndlen = to_send->length;
         break;
 
     case TO:
-        // send destination node id
-        send_byte(control, num, control->shared_ptr->node[num].to_send.to);
-        control->snd_state = FROM;
+        // send destination node id, high byte first
+        send_byte(control, num, ADDR_BYTE(to_send->to, st->snd_hdrpos));
+        if (++st->snd_hdrpos == ADDR_BYTES) {
+            st->snd_state = FROM;
+            st->snd_hdrpos = 0;
+        }
         break;
 
     case FROM:
-        // send source node id
-        send_byte(control, num, control->shared_ptr->node[num].to_send.from);
-        control->snd_state = LEN;
+        // send source node id, high byte first
+        send_byte(control, num, ADDR_BYTE(to_send->from, st->snd_hdrpos));
+        if (++st->snd_hdrpos == ADDR_BYTES) {
+            st->snd_state = LEN;
+            st->snd_hdrpos = 0;
+        }
         break;
 
     case LEN:
         // send packet length
-        send_byte(control, num, control->shared_ptr->node[num].to_send.length);
-        control->snd_state = DATA;
+        send_byte(control, num, to_send->length);
+        st->snd_state = st->sndlen > 0 ? DATA : FCS;
         break;
 
     case DATA:
         // transmit packet data bytes
-#ifdef DEBUG
-        fprintf(stderr, "@ Node %d: Sending data byte %d of %d\n", 
-                num, sndpos, sndlen);
-#endif
-        if (sndpos < (sndlen-1)) {
-            send_byte(control, num, control->shared_ptr->node[num].to_send.data[sndpos]);
-            sndpos++;
-            control->snd_state = DATA;
-            break;
-        } else {
-            if (sem_wait(&control->sems[CRIT]) < 0) {
-                panic("Wait sem failed errno=%d\n", errno);
-            }
-            control->snd_state = DONE;
-            if (sem_post(&control->sems[CRIT]) < 0) {
-                panic("Signal sem failed errno=%d\n", errno);
-            }
+        send_byte(control, num, to_send->data[st->sndpos]);
+        if (++st->sndpos == st->sndlen) {
+            st->snd_state = FCS;
         }
+        break;
+
+    case FCS:
+        // and the frame check sequence, high byte first
+        send_byte(control, num,
+                (to_send->fcs >> (8 * (FCS_BYTES - 1 - st->snd_hdrpos))) & 0xff);
+        if (++st->snd_hdrpos == FCS_BYTES) {
+            st->snd_state = DONE;
+            st->snd_hdrpos = 0;
+        }
+        break;
 
     case DONE:
         // complete transmission and release token
-#ifdef DEBUG
-        fprintf(stderr, "@ Node %d: Packet transmission complete\n", num);
-#endif
-        if (sem_wait(&control->sems[CRIT]) < 0) {
-            panic("Wait sem failed errno=%d\n", errno);
-        }
-#ifdef DEBUG
-        fprintf(stderr, "\ncontents at node: %d is: ", num);
-        for (node_index = 0; node_index < control->shared_ptr->node[num].to_send.length; node_index++) { 
-            fprintf(stderr, "%c", control->shared_ptr->node[num].to_send.data[node_index]);
-        }
-        fprintf(stderr, "\n\n");
-#endif
-        control->shared_ptr->node[num].to_send.token_flag = '1';
-        
-        control->snd_state = TOKEN_FLAG;
+        TRACE(TR_FRAME_END, num, to_send->length, DONE, to_send->to);
+        // the frame keeps its queue slot until it is back round
+        st->snd_state = TOKEN_FLAG;
         send_byte(control, num, '0');
-        if (sem_post(&control->sems[TO_SEND(num)]) < 0) {
-            panic("Signal sem failed errno=%d\n", errno);
-        }
-        if (sem_post(&control->sems[CRIT]) < 0) {
-            panic("Signal sem failed errno=%d\n", errno);
-        }
         break;
     };
 }
 
 /*
- * Send a byte to the next node on the ring.
+ * A frame for node num has arrived.  Count it as received if its FCS
+ * checks out and as corrupted if not.  Returns 1 for a good frame.
+ */
+int
+frame_check(control, num, pkt)
+    struct TokenRingData *control;
+    int num;
+    const struct data_pkt *pkt;
+{
+    const char *payload = pkt_payload(control, pkt);
+
+    if (frame_fcs(pkt, payload) != pkt->fcs) {
+        control->shared_ptr->node[num].fcs_errors++;
+        TRACE(TR_BAD_FCS, num, pkt->length, 0, pkt->from);
+        return 0;
+    }
+    control->shared_ptr->node[num].received++;
+    control->shared_ptr->node[num].mcast_received += pkt->to_group;
+    if (control->cfg.latency) {
+        hist_record(&control->shared_ptr->node[num].lat[LAT_DELIVERY],
+                ring_now(control) - pkt->queued_at);
+    }
+    TRACE(TR_DELIVER, num, pkt->length, 0, pkt->from);
+    return 1;
+}
+
+/*
+ * Node num is done with the frame at the head of its transmit queue.
+ * The frame goes back to the pool; the caller hands the slot back to
+ * the generator.
  */
 void
-send_byte(control, num, byte)
+tx_pop(control, num)
     struct TokenRingData *control;
     int num;
-    unsigned byte;
 {
-    int next = (num + 1) % N_NODES;
+    struct node_data *node = &control->shared_ptr->node[num];
 
-    // check termination before proceeding
-    if (sem_wait(&control->sems[CRIT]) < 0) {
-        panic("Wait sem failed errno=%d\n", errno);
+    pool_put(control->frames, tx_head(control, num));
+    node->tx_head[node->state.tx_prio]++;
+    if (control->cfg.latency) {
+        node->head_at[node->state.tx_prio] = ring_now(control);
+    }
+    atomic_fetch_sub_explicit(&node->pending, 1, memory_order_release);
+}
+
+/*
+ * Node num is about to send the frame at the head of its transmit
+ * queue, the first on a token it has just captured if it holds none
+ * yet, from its highest priority queue with anything in it.  Later
+ * frames on the same token come from the queue tx_more() picked.
+ * Counts the frame, the capture and how long the frame waited.
+ */
+struct data_pkt *
+tx_start(control, num)
+    struct TokenRingData *control;
+    int num;
+{
+    struct node_data *node = &control->shared_ptr->node[num];
+    struct data_pkt *pkt;
+    unsigned long long wait, head;
+    int p;
+
+    if (node->state.held == 0) {
+        node->captures++;
+        node->state.held_bytes = 0;
+        node->state.tx_prio = tx_prio_pending(control, num);
+    }
+    p = node->state.tx_prio;
+    pkt = tx_head(control, num);
+    wait = ring_now(control) - pkt->queued_at;
+    node->state.held++;
+    node->state.held_bytes += pkt->length;
+    if (node->state.held > node->held_max) {
+        node->held_max = node->state.held;
+    }
+    node->sent++;
+    node->payload_sent += pkt->length;
+    node->mcast_sent += pkt->to_group;
+    node->wait_sum += wait;
+    if (wait > node->wait_max) {
+        node->wait_max = wait;
+    }
+    node->prio_sent[p]++;
+    node->prio_wait[p] += wait;
+    if (wait > node->prio_wait_max[p]) {
+        node->prio_wait_max[p] = wait;
+    }
+    if (control->cfg.latency) {
+        // it got to the head of the queue when the one before left
+        head = pkt->queued_at > node->head_at[p] ? pkt->queued_at : node->head_at[p];
+        hist_record(&node->lat[LAT_QUEUE], head - pkt->queued_at);
+        hist_record(&node->lat[LAT_ACCESS], pkt->queued_at + wait - head);
+        node->tx_queued_at = pkt->queued_at;
+    }
+    return pkt;
+}
+
+/*
+ * Whether node num, done with a frame on the token it holds, may send
+ * the next one in its queues before it gives the token up: there has to
+ * be one of at least the token's priority, and it has to fit in the
+ * token holding time (cfg.tht_frames frames and cfg.tht_bytes payload
+ * bytes per capture).
+ */
+int
+tx_more(control, num)
+    struct TokenRingData *control;
+    int num;
+{
+    struct node_data *node = &control->shared_ptr->node[num];
+    int p = tx_prio_pending(control, num);
+
+    // only frames the token's priority lets through
+    if (p < node->state.token_prio)
+        return 0;
+    if (control->cfg.tht_frames
+            && node->state.held >= (int) control->cfg.tht_frames)
+        return 0;
+    node->state.tx_prio = p;
+    if (control->cfg.tht_bytes && node->state.held_bytes
+            + tx_head(control, num)->length > (int) control->cfg.tht_bytes)
+        return 0;
+    return 1;
+}
+
+/*
+ * A free token has reached node num.  Returns 1 if the node takes it,
+ * for a frame of at least the token's priority.  If not, the node
+ * reserves the next token for its highest priority frame by raising the
+ * token's reservation, and passes it on.
+ *
+ * Before anything else, a node that raised the token's priority (see
+ * token_release()) brings it back down when it comes round at that
+ * priority: to the highest reservation made meanwhile, if that is
+ * still above the priority it raised it from, and otherwise all the
+ * way.
+ */
+int
+token_capture(control, num, token)
+    struct TokenRingData *control;
+    int num;
+    struct data_pkt *token;
+{
+    struct node_state *st = &control->shared_ptr->node[num].state;
+    int top = st->stacked - 1;
+    int p;
+
+    if (top >= 0 && token->priority == st->stack_new[top]) {
+        if (token->reservation > st->stack_old[top]) {
+            token->priority = st->stack_new[top] = token->reservation;
+            token->reservation = 0;
+        } else {
+            token->priority = st->stack_old[top];
+            st->stacked--;
+        }
+    }
+
+    p = tx_prio_pending(control, num);
+    if (p >= 0 && p >= token->priority) {
+        st->token_prio = token->priority;
+        return 1;
+    }
+    if (p > token->reservation) {
+        token->reservation = p;
+    }
+    return 0;
+}
+
+/*
+ * Node num gives up the token it holds, with res the highest reservation
+ * made while its frame went round, and fills in the free token to send
+ * on.  A reservation above the token's priority raises it to that, and
+ * the node remembers to lower it again (see token_capture()).
+ */
+void
+token_release(control, num, res, token)
+    struct TokenRingData *control;
+    int num;
+    int res;
+    struct data_pkt *token;
+{
+    struct node_state *st = &control->shared_ptr->node[num].state;
+
+    st->held = 0;
+    st->bridged = 0;
+    st->bridged_bytes = 0;
+    token->token_flag = '0';
+    if (res > st->token_prio && st->stacked < MAX_PRIO) {
+        st->stack_old[st->stacked] = st->token_prio;
+        st->stack_new[st->stacked++] = res;
+        token->priority = res;
+        token->reservation = 0;
+    } else {
+        token->priority = st->token_prio;
+        token->reservation = res;
     }
-    if (control->shared_ptr->node[num].terminate ||
-        control->shared_ptr->cleanup_in_progress) {
-        sem_post(&control->sems[CRIT]);
+    st->token_prio = 0;
+}
+
+/*
+ * A frame from another node is going past node num: reserve the next
+ * token for our highest priority frame if nobody has asked for one as
+ * high.
+ */
+void
+frame_reserve(control, num, pkt)
+    struct TokenRingData *control;
+    int num;
+    struct data_pkt *pkt;
+{
+    int p = tx_prio_pending(control, num);
+
+    if (p > pkt->reservation) {
+        pkt->reservation = p;
+    }
+}
+
+/*
+ * The free token has reached node num, which took it if captured.  With
+ * -R every arrival counts towards the rotation times.  With the virtual
+ * clock, a node that takes the token counts the time since it last went
+ * past as a rotation: the wait of a node with something to send.
+ */
+void
+token_seen(control, num, captured)
+    struct TokenRingData *control;
+    int num;
+    int captured;
+{
+    struct node_data *node = &control->shared_ptr->node[num];
+    unsigned long long rot;
+
+    if (node->rotation) {
+        rotation_token(control, num);
+    }
+    if (!control->cfg.byte_ps) {
         return;
     }
-    sem_post(&control->sems[CRIT]);
+    if (captured && node->vtoken) {
+        rot = node->vnow - node->vtoken;
+        node->rot_sum += rot;
+        node->rot_n++;
+        if (rot > node->rot_max) {
+            node->rot_max = rot;
+        }
+    }
+    node->vtoken = node->vnow;
+}
 
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Attempting to send byte 0x%02X to node %d\n", num, byte, next);
-#endif
+/*
+ * Virtual clock: node num puts nbytes on the link to next.  They go
+ * out once the node has what it is passing on and the link is clear of
+ * what it sent before.  The slot carries the arrival of the first byte,
+ * a byte time plus the propagation delay later: a node repeats a frame
+ * as it comes in (cut-through), so the next node can pass it on before
+ * the rest is in.  Called between taking a slot and publishing it, so
+ * the reader sees the time with the slot.
+ */
+static void
+vclock_send(struct TokenRingData *control, int num, int next, int nbytes)
+{
+    struct node_data *node = &control->shared_ptr->node[num];
+    struct link_data *link = &control->shared_ptr->link[next];
+    unsigned long long t = node->vnow > node->vfree ? node->vnow : node->vfree;
+
+    node->vfree = t + nbytes * control->cfg.byte_ps;
+    link->vt[link->vt_in++ & control->vt_mask] = t + control->cfg.byte_ps
+            + control->cfg.prop_ps;
+}
+
+/*
+ * Virtual clock: node num has taken the oldest slot off its link, and
+ * its clock moves on to when that arrived.
+ */
+static void
+vclock_rcv(struct TokenRingData *control, int num)
+{
+    struct node_data *node = &control->shared_ptr->node[num];
+    struct link_data *link = &control->shared_ptr->link[num];
+    unsigned long long t = link->vt[link->vt_out++ & control->vt_mask];
+
+    if (t > node->vnow) {
+        node->vnow = t;
+    }
+}
+
+/*
+ * Send a byte to the next node on the ring.
+ */
+void
+send_byte(control, num, byte)
+    struct TokenRingData *control;
+    int num;
+    unsigned byte;
+{
+    int next = (num + 1) % control->cfg.n_nodes;
+    struct link_data *link;
 
     // check termination before waiting
-    if (sem_wait(&control->sems[CRIT]) < 0) {
-        panic("Wait sem failed errno=%d\n", errno);
+    if (node_terminating(control, num)) {
+        return;
     }
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Got CRIT semaphore\n", num);
-#endif
-    
-    if (control->shared_ptr->node[num].terminate) {
-#ifdef DEBUG
-        fprintf(stderr, "Node %d: Terminating, won't send byte\n", num);
-#endif
-        sem_post(&control->sems[CRIT]);
+    control->shared_ptr->node[num].xfers++;
+
+    if (control->cfg.link_type == LINK_SPSC) {
+        unsigned char *slot = spsc_write_slot(control, next);
+
+        if (slot == NULL) {
+            return;
+        }
+        *slot = byte;
+        if (control->cfg.byte_ps) {
+            vclock_send(control, num, next, 1);
+        }
+        spsc_write_done(control, next);
+        TRACE(TR_SEND, num, byte, control->shared_ptr->node[num].state.snd_state,
+                next);
         return;
     }
-    sem_post(&control->sems[CRIT]);
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Released CRIT semaphore\n", num);
-#endif
 
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Waiting for EMPTY semaphore of node %d\n", num, next);
-#endif
-    if (sem_wait(&control->sems[EMPTY(next)]) < 0) {
+    TRACE(TR_WAIT_EMPTY, num, byte, 0, next);
+    if (SEM_WAIT(control, EMPTY(next)) < 0) {
         panic("Wait sem failed errno=%d\n", errno);
     }
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Got EMPTY semaphore of node %d\n", num, next);
-#endif
+    TRACE(TR_GOT_EMPTY, num, byte, 0, next);
 
-    control->shared_ptr->node[next].data_xfer = byte;
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Wrote byte 0x%02X to node %d's buffer\n", num, byte, next);
-#endif
+    link = &control->shared_ptr->link[next];
+    link->data_xfer[link->next_empty] = byte;
+    link->next_empty = (link->next_empty + 1) % control->cfg.link_depth;
+    if (control->cfg.byte_ps) {
+        vclock_send(control, num, next, 1);
+    }
     
     if (sem_post(&control->sems[FILLED(next)]) < 0) {
         panic("Signal sem failed errno=%d\n", errno);
     }
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Signaled FILLED semaphore of node %d\n", num, next);
-#endif
+    TRACE(TR_SEND, num, byte, control->shared_ptr->node[num].state.snd_state,
+            next);
 }
 
 /*
@@ -472,64 +1021,180 @@ rcv_byte(control, num)
     struct TokenRingData *control;
     int num;
 {
+    struct link_data *link;
     unsigned char byte;
 
     // check termination before waiting
-    if (sem_wait(&control->sems[CRIT]) < 0) {
-        panic("Wait sem failed errno=%d\n", errno);
-    }
-    if (control->shared_ptr->node[num].terminate ||
-        control->shared_ptr->cleanup_in_progress) {
-        sem_post(&control->sems[CRIT]);
+    if (node_terminating(control, num)) {
         return 0;
     }
-    sem_post(&control->sems[CRIT]);
 
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Attempting to receive byte\n", num);
-#endif
+    if (control->cfg.link_type == LINK_SPSC) {
+        unsigned char *slot = spsc_read_slot(control, num);
 
-    // check termination before waiting
-    if (sem_wait(&control->sems[CRIT]) < 0) {
+        if (slot == NULL) {
+            return 0;
+        }
+        byte = *slot;
+        if (control->cfg.byte_ps) {
+            vclock_rcv(control, num);
+        }
+        spsc_read_done(control, num);
+        TRACE(TR_RCV, num, byte, control->shared_ptr->node[num].state.rcv_state,
+                0);
+        return byte;
+    }
+
+    TRACE(TR_WAIT_FILLED, num, 0, 0, 0);
+    if (SEM_WAIT(control, FILLED(num)) < 0) {
         panic("Wait sem failed errno=%d\n", errno);
     }
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Got CRIT semaphore for receive\n", num);
-#endif
+    TRACE(TR_GOT_FILLED, num, 0, 0, 0);
     
-    if (control->shared_ptr->node[num].terminate) {
-#ifdef DEBUG
-        fprintf(stderr, "Node %d: Terminating, won't receive byte\n", num);
-#endif
-        sem_post(&control->sems[CRIT]);
+    link = &control->shared_ptr->link[num];
+    byte = link->data_xfer[link->next_full];
+    link->next_full = (link->next_full + 1) % control->cfg.link_depth;
+    if (control->cfg.byte_ps) {
+        vclock_rcv(control, num);
+    }
+
+    if (sem_post(&control->sems[EMPTY(num)]) < 0) {
+        panic("Signal sem failed errno=%d\n", errno);
+    }
+    TRACE(TR_RCV, num, byte, control->shared_ptr->node[num].state.rcv_state, 0);
+    
+    return byte;
+}
+
+/*
+ * Copy a frame between a node and a link slot.  Only the header and
+ * the length bytes of data in use are copied, and with zero-copy only
+ * the header, which holds the reference to the sender's payload.
+ */
+static void
+copy_frame(struct TokenRingData *control, struct data_pkt *dst,
+        const struct data_pkt *src)
+{
+    dst->token_flag = src->token_flag;
+    dst->priority = src->priority;
+    dst->reservation = src->reservation;
+    dst->to_group = src->to_group;
+    dst->refused = src->refused;
+    dst->to = src->to;
+    dst->from = src->from;
+    dst->to_ring = src->to_ring;
+    dst->from_ring = src->from_ring;
+    dst->length = src->length;
+    dst->fcs = src->fcs;
+    dst->payload = src->payload;
+    dst->queued_at = src->queued_at;
+    if (!control->cfg.zero_copy) {
+        memcpy(dst->data, src->data, src->length);
+    }
+}
+
+/*
+ * Send a whole frame to the next node on the ring.
+ */
+void
+send_frame(control, num, pkt)
+    struct TokenRingData *control;
+    int num;
+    const struct data_pkt *pkt;
+{
+    int next = (num + 1) % control->cfg.n_nodes;
+    struct link_data *link = &control->shared_ptr->link[next];
+    struct data_pkt *slot;
+
+    if (node_terminating(control, num)) {
+        return;
+    }
+    control->shared_ptr->node[num].xfers++;
+
+    if (control->cfg.link_type == LINK_SPSC) {
+        if ((slot = spsc_write_slot(control, next)) == NULL) {
+            return;
+        }
+        copy_frame(control, slot, pkt);
+        if (control->cfg.byte_ps) {
+            vclock_send(control, num, next, FRAME_WIRE_BYTES(pkt));
+        }
+        spsc_write_done(control, next);
+        TRACE(TR_SEND_FRAME, num, pkt->token_flag, 0, next);
+        return;
+    }
+
+    TRACE(TR_WAIT_EMPTY, num, pkt->token_flag, 0, next);
+    if (SEM_WAIT(control, EMPTY(next)) < 0) {
+        panic("Wait sem failed errno=%d\n", errno);
+    }
+    TRACE(TR_GOT_EMPTY, num, pkt->token_flag, 0, next);
+
+    slot = &link->frame_xfer[link->next_empty];
+    link->next_empty = (link->next_empty + 1) % control->cfg.link_depth;
+    copy_frame(control, slot, pkt);
+    if (control->cfg.byte_ps) {
+        vclock_send(control, num, next, FRAME_WIRE_BYTES(pkt));
+    }
+
+    if (sem_post(&control->sems[FILLED(next)]) < 0) {
+        panic("Signal sem failed errno=%d\n", errno);
+    }
+    TRACE(TR_SEND_FRAME, num, pkt->token_flag, 0, next);
+}
+
+/*
+ * Receive a whole frame for this node.  Returns 0 once the node has
+ * been told to terminate, 1 when pkt holds a frame.
+ */
+int
+rcv_frame(control, num, pkt)
+    struct TokenRingData *control;
+    int num;
+    struct data_pkt *pkt;
+{
+    struct link_data *link = &control->shared_ptr->link[num];
+    struct data_pkt *slot;
+
+    if (node_terminating(control, num)) {
         return 0;
     }
-    sem_post(&control->sems[CRIT]);
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Released CRIT semaphore for receive\n", num);
-#endif
 
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Waiting for FILLED semaphore\n", num);
-#endif
-    if (sem_wait(&control->sems[FILLED(num)]) < 0) {
+    if (control->cfg.link_type == LINK_SPSC) {
+        if ((slot = spsc_read_slot(control, num)) == NULL) {
+            return 0;
+        }
+        copy_frame(control, pkt, slot);
+        if (control->cfg.byte_ps) {
+            vclock_rcv(control, num);
+        }
+        spsc_read_done(control, num);
+        TRACE(TR_RCV_FRAME, num, pkt->token_flag, 0, 0);
+        return 1;
+    }
+
+    TRACE(TR_WAIT_FILLED, num, 0, 0, 0);
+    if (SEM_WAIT(control, FILLED(num)) < 0) {
         panic("Wait sem failed errno=%d\n", errno);
     }
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Got FILLED semaphore\n", num);
-#endif
-    
-    byte = control->shared_ptr->node[num].data_xfer;
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Read byte 0x%02X from buffer\n", num, byte);
-#endif
+    TRACE(TR_GOT_FILLED, num, 0, 0, 0);
+
+    // woken up by the shutdown rather than by a neighbour
+    if (node_terminating(control, num)) {
+        return 0;
+    }
+
+    slot = &link->frame_xfer[link->next_full];
+    link->next_full = (link->next_full + 1) % control->cfg.link_depth;
+    copy_frame(control, pkt, slot);
+    if (control->cfg.byte_ps) {
+        vclock_rcv(control, num);
+    }
 
     if (sem_post(&control->sems[EMPTY(num)]) < 0) {
         panic("Signal sem failed errno=%d\n", errno);
     }
-#ifdef DEBUG
-    fprintf(stderr, "Node %d: Signaled EMPTY semaphore\n", num);
-#endif
-    
-    return byte;
+    TRACE(TR_RCV_FRAME, num, pkt->token_flag, 0, 0);
+
+    return 1;
 }
@@ -0,0 +1,160 @@
+/*
+ * Binary trace buffers (DEBUG builds).
+ *
+ * Printing every byte a node moves serialises all the nodes on the
+ * stdio lock, and takes long enough to hide the timing being looked
+ * at.  Instead each thread records fixed-size events into a buffer of
+ * its own, TRACE_EVENTS long, keeping the most recent.  Recording takes
+ * no locks and makes no calls: a thread only takes trace_lock once, to
+ * put its buffer on the list, the first time it records anything.
+ *
+ * Nothing is recorded unless $TOKENSIM_TRACE is set, naming the file to
+ * write (TRACE_FILE if it is empty).  The buffers together take at most
+ * TRACE_MEMORY; threads that start recording once it is used up, on a
+ * big ring, record nothing.
+ *
+ * At exit the buffers are written out with the trace_clock() rate
+ * measured over the run, so tracedump can put the events on a timeline
+ * in microseconds.  The file is
+ *
+ *	TRACE_MAGIC, then uint32 buffers, uint32 TRACE_EVENTS,
+ *	double ns per tick, uint64 first tick;
+ *	for each buffer: uint32 thread, uint32 events, uint64 dropped,
+ *	then the events, oldest first.
+ *
+ * Buffers outlive their threads, so the node threads are long gone by
+ * the time they are written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "tokenRing.h"
+
+_Thread_local struct trace_buf *trace_mine;
+_Thread_local int trace_none;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *trace_name;		/* where to, once looked up */
+static int trace_looked;
+static struct trace_buf *trace_bufs;	/* newest first		*/
+static unsigned trace_threads;
+static unsigned trace_untraced;		/* over TRACE_MEMORY	*/
+static uint64_t trace_tsc0;		/* trace_clock() and	*/
+static unsigned long long trace_ns0;	/* CLOCK_MONOTONIC at	*/
+					/* the first event	*/
+
+static unsigned long long
+mono_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void
+trace_flush(void)
+{
+	struct trace_buf *tb;
+	const char *name = trace_name;
+	uint32_t u32;
+	uint64_t u64, dropped;
+	unsigned long long first;
+	double ns_per_tick;
+	FILE *f;
+
+	if ((f = fopen(name, "wb")) == NULL) {
+		fprintf(stderr, "Cannot write trace to %s\n", name);
+		return;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	u64 = trace_clock() - trace_tsc0;
+	ns_per_tick = u64 ? (double) (mono_ns() - trace_ns0) / u64 : 1.0;
+	fwrite(TRACE_MAGIC, 1, 8, f);
+	u32 = trace_threads;
+	fwrite(&u32, sizeof(u32), 1, f);
+	u32 = TRACE_EVENTS;
+	fwrite(&u32, sizeof(u32), 1, f);
+	fwrite(&ns_per_tick, sizeof(ns_per_tick), 1, f);
+	fwrite(&trace_tsc0, sizeof(trace_tsc0), 1, f);
+
+	for (tb = trace_bufs; tb; tb = tb->link) {
+		first = tb->next > TRACE_EVENTS ? tb->next - TRACE_EVENTS : 0;
+		dropped = first;
+		u32 = tb->thread;
+		fwrite(&u32, sizeof(u32), 1, f);
+		u32 = (uint32_t) (tb->next - first);
+		fwrite(&u32, sizeof(u32), 1, f);
+		fwrite(&dropped, sizeof(dropped), 1, f);
+		// oldest first: from the wrap point to the end, then the start
+		if (first % TRACE_EVENTS) {
+			fwrite(&tb->events[first % TRACE_EVENTS], sizeof(struct trace_event),
+					TRACE_EVENTS - first % TRACE_EVENTS, f);
+			fwrite(tb->events, sizeof(struct trace_event),
+					first % TRACE_EVENTS, f);
+		} else {
+			fwrite(tb->events, sizeof(struct trace_event),
+					tb->next - first, f);
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Cannot write trace to %s\n", name);
+	}
+	fprintf(stderr, "trace: %u threads written to %s\n", trace_threads, name);
+	if (trace_untraced) {
+		fprintf(stderr, "trace: %u more threads not traced, over %d bytes; "
+				"build with a larger -DTRACE_MEMORY\n", trace_untraced,
+				TRACE_MEMORY);
+	}
+}
+
+/*
+ * Give the calling thread a buffer.  Returns NULL, and sets trace_none
+ * so the thread does not ask again, if tracing is off, TRACE_MEMORY is
+ * used up or there is no memory for one.  Only the events up to next
+ * are ever read, so the buffer is not cleared.
+ */
+struct trace_buf *
+trace_attach(void)
+{
+	struct trace_buf *tb = NULL;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_looked) {
+		trace_name = getenv("TOKENSIM_TRACE");
+		if (trace_name && !*trace_name)
+			trace_name = TRACE_FILE;
+		trace_looked = 1;
+	}
+	if (trace_name == NULL) {
+		goto NONE;
+	}
+	if ((trace_threads + 1) * sizeof(struct trace_buf) > TRACE_MEMORY
+			|| (tb = malloc(sizeof(struct trace_buf))) == NULL) {
+		trace_untraced++;
+		goto NONE;
+	}
+	if (trace_threads == 0) {
+		trace_tsc0 = trace_clock();
+		trace_ns0 = mono_ns();
+		atexit(trace_flush);
+	}
+	tb->thread = trace_threads++;
+	tb->next = 0;
+	tb->link = trace_bufs;
+	trace_bufs = tb;
+NONE:
+	pthread_mutex_unlock(&trace_lock);
+	if (tb == NULL) {
+		trace_none = 1;
+		return NULL;
+	}
+
+	trace_mine = tb;
+	return tb;
+}
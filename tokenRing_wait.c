@@ -0,0 +1,163 @@
+/*
+ * Wait strategies used by the lock-free links.
+ *
+ * A waiter samples an event's sequence number, re-checks its condition
+ * (data in the link, room in the link) and only then waits for the
+ * sequence number to move.  The other side bumps the sequence number
+ * after changing the link and wakes the waiter if one has parked, so a
+ * wakeup can never be lost between the check and the wait.  How the
+ * waiter waits is the strategy:
+ *
+ *	WAIT_BLOCK	park on a POSIX semaphore, like the semaphore link
+ *	WAIT_SPIN	busy-poll with a pause instruction, never park; yield
+ *			the CPU every WAIT_SPIN_LIMIT rounds
+ *	WAIT_SPINPARK	poll for WAIT_SPIN_LIMIT rounds, then futex wait
+ *	WAIT_FUTEX	futex wait straight away
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "tokenRing.h"
+
+static const char *wait_names[] = { "block", "spin", "spinpark", "futex" };
+
+/*
+ * Map a strategy name from the command line to its WAIT_ number,
+ * or -1 if it is not one we know.
+ */
+int
+wait_strategy_from_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < (int) (sizeof(wait_names) / sizeof(wait_names[0])); i++) {
+		if (strcmp(name, wait_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *
+wait_strategy_name(int strategy)
+{
+	return wait_names[strategy];
+}
+
+static void
+futex_wait(atomic_uint *addr, unsigned val)
+{
+	if (syscall(SYS_futex, (unsigned *) addr, FUTEX_WAIT_PRIVATE,
+			val, NULL, NULL, 0) < 0
+			&& errno != EAGAIN && errno != EINTR) {
+		panic("futex wait failed errno=%d\n", errno);
+	}
+}
+
+static void
+futex_wake(atomic_uint *addr)
+{
+	if (syscall(SYS_futex, (unsigned *) addr, FUTEX_WAKE_PRIVATE,
+			1, NULL, NULL, 0) < 0) {
+		panic("futex wake failed errno=%d\n", errno);
+	}
+}
+
+int
+wait_event_init(struct wait_event *ev)
+{
+	atomic_init(&ev->seq, 0);
+	atomic_init(&ev->waiters, 0);
+	if (sem_init(&ev->sem, 0, 0) < 0) {
+		fprintf(stderr, "Failed to initialize wait event semaphore\n");
+		return -1;
+	}
+	return 0;
+}
+
+void
+wait_event_destroy(struct wait_event *ev)
+{
+	sem_destroy(&ev->sem);
+}
+
+/*
+ * Take the key to wait on.  Must be called before the waiter's final
+ * check of its condition.
+ */
+unsigned
+wait_event_prepare(struct wait_event *ev)
+{
+	return atomic_load(&ev->seq);
+}
+
+/*
+ * Wait until the event has been signalled since key was taken.  May
+ * return early; callers re-check their condition and come back.
+ */
+void
+wait_event_wait(struct wait_event *ev, unsigned key, int strategy)
+{
+	int i;
+
+	switch (strategy) {
+	case WAIT_SPIN:
+		// with more threads than CPUs the one we wait on may need ours
+		for (i = 1; atomic_load_explicit(&ev->seq, memory_order_acquire) == key;
+				i++) {
+			if (i % WAIT_SPIN_LIMIT == 0)
+				sched_yield();
+			else
+				cpu_relax();
+		}
+		break;
+
+	case WAIT_SPINPARK:
+		for (i = 0; i < WAIT_SPIN_LIMIT; i++) {
+			if (atomic_load_explicit(&ev->seq, memory_order_acquire) != key)
+				return;
+			cpu_relax();
+		}
+		/* FALLTHROUGH */
+
+	case WAIT_FUTEX:
+		atomic_fetch_add(&ev->waiters, 1);
+		futex_wait(&ev->seq, key);
+		atomic_fetch_sub(&ev->waiters, 1);
+		break;
+
+	case WAIT_BLOCK:
+	default:
+		atomic_fetch_add(&ev->waiters, 1);
+		if (atomic_load(&ev->seq) == key) {
+			while (sem_wait(&ev->sem) < 0 && errno == EINTR)
+				;
+		}
+		atomic_fetch_sub(&ev->waiters, 1);
+		break;
+	}
+}
+
+/*
+ * Tell a waiter the condition it is waiting on may have changed.
+ * Pure spinners poll the sequence number, so only the parking
+ * strategies pay for a system call, and only when someone is parked.
+ */
+void
+wait_event_signal(struct wait_event *ev, int strategy)
+{
+	atomic_fetch_add(&ev->seq, 1);
+	if (strategy == WAIT_SPIN || atomic_load(&ev->waiters) == 0)
+		return;
+
+	if (strategy == WAIT_BLOCK) {
+		if (sem_post(&ev->sem) < 0) {
+			panic("Signal sem failed errno=%d\n", errno);
+		}
+	} else {
+		futex_wake(&ev->seq);
+	}
+}
@@ -0,0 +1,179 @@
+/*
+ * tracedump: turn a tokensim trace (see tokenRing_trace.c) into Chrome
+ * trace event JSON, for chrome://tracing or ui.perfetto.dev.
+ *
+ *	usage: tracedump [tokensim.trace] > trace.json
+ *
+ * Each node gets a track of its own.  Bytes and frames moving are
+ * instant events, and waits on a link, and a node sending its frame,
+ * are slices.  The position of the free token is a counter, so the
+ * token can be followed round the ring as a sawtooth.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tokenRing.h"
+
+static const char *names[TR_NUM] = {
+	NULL, "start", "stop", "send", "rcv", "wait empty", NULL,
+	"wait filled", NULL, "token", "frame", NULL, "send frame",
+	"rcv frame", "strip", "dest strip", "deliver", "bad fcs", "queue"
+};
+
+/*
+ * The start of a slice waiting for its end, per node: waiting for room
+ * on the outbound link, waiting for something on the inbound one,
+ * sending a frame.
+ */
+struct open_slices {
+	double		at[3];
+	int		open[3];
+};
+
+static double ns_per_tick;
+static uint64_t tsc0;
+static int first = 1;
+
+static double
+us(uint64_t tsc)
+{
+	return (double) (int64_t) (tsc - tsc0) * ns_per_tick / 1e3;
+}
+
+static void
+comma(void)
+{
+	if (!first)
+		printf(",\n");
+	first = 0;
+}
+
+static void
+slice(const char *name, int node, double start, double end)
+{
+	comma();
+	printf("{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, "
+			"\"ts\": %.3f, \"dur\": %.3f}", name, node, start, end - start);
+}
+
+static void
+event(const struct trace_event *e, unsigned thread, struct open_slices *open)
+{
+	static const char *slices[3] = { "waiting for room", "waiting for data",
+		"sending frame" };
+	double t = us(e->tsc);
+	int s = -1, begin = 0;
+
+	switch (e->event) {
+	case TR_WAIT_EMPTY:
+		begin = 1;
+		/* fall through */
+	case TR_GOT_EMPTY:
+		s = 0;
+		break;
+	case TR_WAIT_FILLED:
+		begin = 1;
+		/* fall through */
+	case TR_GOT_FILLED:
+		s = 1;
+		break;
+	case TR_FRAME_START:
+		s = 2;
+		begin = 1;
+		break;
+	case TR_FRAME_END:
+	case TR_STRIP:
+		if (open[e->node].open[2]) {
+			slice(slices[2], e->node, open[e->node].at[2], t);
+			open[e->node].open[2] = 0;
+		}
+		break;
+	}
+	if (s >= 0 && s < 2) {
+		if (begin) {
+			open[e->node].at[s] = t;
+			open[e->node].open[s] = 1;
+		} else if (open[e->node].open[s]) {
+			slice(slices[s], e->node, open[e->node].at[s], t);
+			open[e->node].open[s] = 0;
+		}
+		return;
+	}
+	if (s == 2) {
+		open[e->node].at[s] = t;
+		open[e->node].open[s] = 1;
+	}
+
+	if (e->event >= TR_NUM || !names[e->event])
+		return;
+	comma();
+	printf("{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 0, "
+			"\"tid\": %d, \"ts\": %.3f, \"args\": {\"byte\": %u, "
+			"\"state\": %u, \"arg\": %u, \"thread\": %u}}", names[e->event],
+			e->node, t, e->byte, e->state, e->arg, thread);
+
+	// the free token is where a node last saw it
+	if (e->event == TR_TOKEN) {
+		comma();
+		printf("{\"name\": \"token\", \"ph\": \"C\", \"pid\": 0, "
+				"\"ts\": %.3f, \"args\": {\"node\": %u}}", t, e->node);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : TRACE_FILE;
+	struct trace_event *events;
+	struct open_slices *open;
+	uint32_t n_bufs, size, thread, count, i, b;
+	uint64_t dropped;
+	char magic[8];
+	FILE *f;
+
+	if ((f = fopen(name, "rb")) == NULL) {
+		fprintf(stderr, "Cannot open %s\n", name);
+		return 1;
+	}
+	if (fread(magic, 1, 8, f) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0
+			|| fread(&n_bufs, sizeof(n_bufs), 1, f) != 1
+			|| fread(&size, sizeof(size), 1, f) != 1
+			|| fread(&ns_per_tick, sizeof(ns_per_tick), 1, f) != 1
+			|| fread(&tsc0, sizeof(tsc0), 1, f) != 1) {
+		fprintf(stderr, "%s is not a tokensim trace\n", name);
+		return 1;
+	}
+	events = malloc((size_t) size * sizeof(struct trace_event));
+	open = calloc(MAX_NODES + 1, sizeof(struct open_slices));
+	if (!events || !open) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	for (b = 0; b < n_bufs; b++) {
+		if (fread(&thread, sizeof(thread), 1, f) != 1
+				|| fread(&count, sizeof(count), 1, f) != 1
+				|| fread(&dropped, sizeof(dropped), 1, f) != 1
+				|| count > size
+				|| fread(events, sizeof(struct trace_event), count, f) != count) {
+			fprintf(stderr, "%s is cut short\n", name);
+			break;
+		}
+		if (dropped) {
+			fprintf(stderr, "thread %u: %llu oldest events lost\n", thread,
+					(unsigned long long) dropped);
+		}
+		// slices do not span threads
+		memset(open, 0, (MAX_NODES + 1) * sizeof(struct open_slices));
+		for (i = 0; i < count; i++) {
+			event(&events[i], thread, open);
+		}
+	}
+	printf("\n]}\n");
+
+	fclose(f);
+	free(events);
+	free(open);
+	return 0;
+}